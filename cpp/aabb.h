@@ -0,0 +1,54 @@
+#pragma once
+
+#include "rtweekend.h"
+
+struct aabb
+{
+	point3 min{infinity};
+	point3 max{-infinity};
+
+	void expand(const point3& p)
+	{
+		min = vmin(min, p);
+		max = vmax(max, p);
+	}
+
+	void expand(const aabb& b)
+	{
+		min = vmin(min, b.min);
+		max = vmax(max, b.max);
+	}
+
+	bool empty() const
+	{
+		return min.x() > max.x() || min.y() > max.y() || min.z() > max.z();
+	}
+
+	point3 center() const
+	{
+		return 0.5 * (min + max);
+	}
+
+	vec3 extent() const
+	{
+		return max - min;
+	}
+
+	real_t surface_area() const
+	{
+		if (empty())
+			return 0;
+		auto e = extent();
+		return 2 * (e.x() * e.y() + e.y() * e.z() + e.z() * e.x());
+	}
+
+	int longest_axis() const
+	{
+		auto e = extent();
+		if (e.x() > e.y() && e.x() > e.z())
+			return 0;
+		if (e.y() > e.z())
+			return 1;
+		return 2;
+	}
+};
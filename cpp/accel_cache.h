@@ -0,0 +1,308 @@
+#pragma once
+
+#include "bvh.h"
+#include "bvh_quantized.h"
+#include "mapped_file.h"
+#include "material.h"
+#include "parallel.h"
+#include "sphere.h"
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <string.h>
+#include <vector>
+
+// read only arrays the traversal runs on, they point either into the vectors built by
+// prepare_soa or into a mapped accel cache file
+struct accel_view
+{
+	const real_t* center_x;
+	const real_t* center_y;
+	const real_t* center_z;
+	const real_t* radius;
+	const int* mat_index;
+	// spheres count, the first bounded_count are in the accelerators and the rest are the
+	// huge spheres tested on every ray, the soa arrays are padded to soa_count
+	uint32_t sphere_count;
+	uint32_t bounded_count;
+	uint32_t soa_count;
+
+	const bvh_node* nodes;
+	uint32_t node_count;
+
+	const float* wide_min_x;
+	const float* wide_min_y;
+	const float* wide_min_z;
+	const float* wide_max_x;
+	const float* wide_max_y;
+	const float* wide_max_z;
+	const int* wide_child;
+	const int* wide_count;
+	uint32_t wide_width;
+	uint32_t wide_node_count;
+
+	const bvhq_node* quantized_nodes;
+	uint32_t quantized_node_count;
+};
+
+constexpr char ACCEL_CACHE_MAGIC[8] = {'R', 'T', 'O', 'W', 'A', 'C', 'C', '\0'};
+// bump whenever the layout of the file or of any of the nodes changes
+constexpr uint32_t ACCEL_CACHE_VERSION = 2;
+// every section starts on its own cache line
+constexpr uint64_t ACCEL_CACHE_ALIGNMENT = 64;
+constexpr uint32_t ACCEL_CACHE_HASH_BLOCK = 64 * 1024;
+
+enum ACCEL_CACHE_SECTION
+{
+	ACCEL_CACHE_CENTER_X,
+	ACCEL_CACHE_CENTER_Y,
+	ACCEL_CACHE_CENTER_Z,
+	ACCEL_CACHE_RADIUS,
+	ACCEL_CACHE_MAT_INDEX,
+	ACCEL_CACHE_NODES,
+	ACCEL_CACHE_WIDE_MIN_X,
+	ACCEL_CACHE_WIDE_MIN_Y,
+	ACCEL_CACHE_WIDE_MIN_Z,
+	ACCEL_CACHE_WIDE_MAX_X,
+	ACCEL_CACHE_WIDE_MAX_Y,
+	ACCEL_CACHE_WIDE_MAX_Z,
+	ACCEL_CACHE_WIDE_CHILD,
+	ACCEL_CACHE_WIDE_COUNT,
+	ACCEL_CACHE_QUANTIZED_NODES,
+	ACCEL_CACHE_SECTION_COUNT,
+};
+
+struct accel_cache_header
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t sphere_count;
+	uint64_t key;
+	uint32_t soa_count;
+	uint32_t node_count;
+	uint32_t wide_width;
+	uint32_t wide_node_count;
+	uint32_t quantized_node_count;
+	uint32_t bounded_count;
+	uint64_t offsets[ACCEL_CACHE_SECTION_COUNT];
+};
+
+inline static uint64_t
+_fnv1a(uint64_t hash, const void* data, size_t size)
+{
+	auto bytes = (const uint8_t*)data;
+	for (size_t i = 0; i < size; ++i)
+	{
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ull;
+	}
+	return hash;
+}
+
+inline static uint64_t
+_align_up(uint64_t num, uint64_t alignment)
+{
+	return (num + alignment - 1) / alignment * alignment;
+}
+
+// hash of everything the acceleration structure is built from and of the accelerator whose
+// nodes the file holds, the spheres are hashed in fixed size blocks in parallel so the key
+// doesn't depend on the thread count
+inline static uint64_t
+accel_cache_key(enki::TaskScheduler* ts, const std::vector<sphere>& spheres, const std::vector<material>& materials, uint32_t builder, uint32_t accel)
+{
+	const uint64_t fnv_offset = 0xcbf29ce484222325ull;
+
+	auto block_count = uint32_t((spheres.size() + ACCEL_CACHE_HASH_BLOCK - 1) / ACCEL_CACHE_HASH_BLOCK);
+	std::vector<uint64_t> block_hashes(block_count);
+	parallel_for(ts, block_count, 1, [&](uint32_t start, uint32_t end, uint32_t) {
+		for (auto block = start; block < end; ++block)
+		{
+			auto hash = fnv_offset;
+			auto first = size_t(block) * ACCEL_CACHE_HASH_BLOCK;
+			auto last = std::min(spheres.size(), first + ACCEL_CACHE_HASH_BLOCK);
+			for (auto i = first; i < last; ++i)
+			{
+				const auto& s = spheres[i];
+				float fields[4] = {s.center.x(), s.center.y(), s.center.z(), s.radius};
+				hash = _fnv1a(hash, fields, sizeof(fields));
+				hash = _fnv1a(hash, &s.mat_index, sizeof(s.mat_index));
+				hash = _fnv1a(hash, &s.unbounded, sizeof(s.unbounded));
+			}
+			block_hashes[block] = hash;
+		}
+	});
+
+	auto hash = _fnv1a(fnv_offset, &ACCEL_CACHE_VERSION, sizeof(ACCEL_CACHE_VERSION));
+	hash = _fnv1a(hash, &builder, sizeof(builder));
+	hash = _fnv1a(hash, &accel, sizeof(accel));
+	hash = _fnv1a(hash, block_hashes.data(), block_hashes.size() * sizeof(uint64_t));
+	for (const auto& m: materials)
+	{
+		int kind = m.kind;
+		float fields[5] = {m.albedo.x(), m.albedo.y(), m.albedo.z(), m.fuzz, m.ir};
+		hash = _fnv1a(hash, &kind, sizeof(kind));
+		hash = _fnv1a(hash, fields, sizeof(fields));
+	}
+	return hash;
+}
+
+inline static std::string
+accel_cache_path(const char* dir, uint64_t key)
+{
+	char name[32];
+	snprintf(name, sizeof(name), "%016llx.rtacc", (unsigned long long)key);
+	return std::string{dir} + "/" + name;
+}
+
+inline static void
+_accel_cache_sections(const accel_view& view, const void* data[ACCEL_CACHE_SECTION_COUNT], uint64_t size[ACCEL_CACHE_SECTION_COUNT])
+{
+	uint64_t wide_slots = uint64_t(view.wide_node_count) * view.wide_width;
+	data[ACCEL_CACHE_CENTER_X] = view.center_x; size[ACCEL_CACHE_CENTER_X] = view.soa_count * sizeof(real_t);
+	data[ACCEL_CACHE_CENTER_Y] = view.center_y; size[ACCEL_CACHE_CENTER_Y] = view.soa_count * sizeof(real_t);
+	data[ACCEL_CACHE_CENTER_Z] = view.center_z; size[ACCEL_CACHE_CENTER_Z] = view.soa_count * sizeof(real_t);
+	data[ACCEL_CACHE_RADIUS] = view.radius; size[ACCEL_CACHE_RADIUS] = view.soa_count * sizeof(real_t);
+	data[ACCEL_CACHE_MAT_INDEX] = view.mat_index; size[ACCEL_CACHE_MAT_INDEX] = view.soa_count * sizeof(int);
+	data[ACCEL_CACHE_NODES] = view.nodes; size[ACCEL_CACHE_NODES] = view.node_count * sizeof(bvh_node);
+	data[ACCEL_CACHE_WIDE_MIN_X] = view.wide_min_x; size[ACCEL_CACHE_WIDE_MIN_X] = wide_slots * sizeof(float);
+	data[ACCEL_CACHE_WIDE_MIN_Y] = view.wide_min_y; size[ACCEL_CACHE_WIDE_MIN_Y] = wide_slots * sizeof(float);
+	data[ACCEL_CACHE_WIDE_MIN_Z] = view.wide_min_z; size[ACCEL_CACHE_WIDE_MIN_Z] = wide_slots * sizeof(float);
+	data[ACCEL_CACHE_WIDE_MAX_X] = view.wide_max_x; size[ACCEL_CACHE_WIDE_MAX_X] = wide_slots * sizeof(float);
+	data[ACCEL_CACHE_WIDE_MAX_Y] = view.wide_max_y; size[ACCEL_CACHE_WIDE_MAX_Y] = wide_slots * sizeof(float);
+	data[ACCEL_CACHE_WIDE_MAX_Z] = view.wide_max_z; size[ACCEL_CACHE_WIDE_MAX_Z] = wide_slots * sizeof(float);
+	data[ACCEL_CACHE_WIDE_CHILD] = view.wide_child; size[ACCEL_CACHE_WIDE_CHILD] = wide_slots * sizeof(int);
+	data[ACCEL_CACHE_WIDE_COUNT] = view.wide_count; size[ACCEL_CACHE_WIDE_COUNT] = wide_slots * sizeof(int);
+	data[ACCEL_CACHE_QUANTIZED_NODES] = view.quantized_nodes; size[ACCEL_CACHE_QUANTIZED_NODES] = view.quantized_node_count * sizeof(bvhq_node);
+}
+
+// writes the view to a temporary file then renames it into place so that concurrent jobs
+// never map a half written cache
+inline static bool
+accel_cache_save(const char* path, uint64_t key, const accel_view& view)
+{
+	accel_cache_header header{};
+	memcpy(header.magic, ACCEL_CACHE_MAGIC, sizeof(header.magic));
+	header.version = ACCEL_CACHE_VERSION;
+	header.sphere_count = view.sphere_count;
+	header.key = key;
+	header.soa_count = view.soa_count;
+	header.node_count = view.node_count;
+	header.wide_width = view.wide_width;
+	header.wide_node_count = view.wide_node_count;
+	header.quantized_node_count = view.quantized_node_count;
+	header.bounded_count = view.bounded_count;
+
+	const void* data[ACCEL_CACHE_SECTION_COUNT];
+	uint64_t size[ACCEL_CACHE_SECTION_COUNT];
+	_accel_cache_sections(view, data, size);
+
+	auto offset = _align_up(sizeof(header), ACCEL_CACHE_ALIGNMENT);
+	for (int s = 0; s < ACCEL_CACHE_SECTION_COUNT; ++s)
+	{
+		header.offsets[s] = offset;
+		offset = _align_up(offset + size[s], ACCEL_CACHE_ALIGNMENT);
+	}
+
+	auto tmp_path = std::string{path} + "." + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()) + ".tmp";
+	{
+		std::ofstream out{tmp_path, std::ios::binary};
+		if (out.is_open() == false)
+			return false;
+
+		const char zeros[ACCEL_CACHE_ALIGNMENT]{};
+		out.write((const char*)&header, sizeof(header));
+		uint64_t written = sizeof(header);
+		for (int s = 0; s < ACCEL_CACHE_SECTION_COUNT; ++s)
+		{
+			out.write(zeros, std::streamsize(header.offsets[s] - written));
+			out.write((const char*)data[s], std::streamsize(size[s]));
+			written = header.offsets[s] + size[s];
+		}
+		out.write(zeros, std::streamsize(offset - written));
+		if (out.good() == false)
+		{
+			out.close();
+			std::remove(tmp_path.c_str());
+			return false;
+		}
+	}
+
+	if (std::rename(tmp_path.c_str(), path) != 0)
+	{
+		std::remove(tmp_path.c_str());
+		return false;
+	}
+	return true;
+}
+
+// maps the cache file and points the view straight into it, nothing is copied
+// fails if the file is missing, truncated, from another version or for other scene data
+inline static bool
+accel_cache_load(mapped_file& file, const char* path, uint64_t key, uint32_t sphere_count, accel_view& view)
+{
+	if (file.open(path) == false)
+		return false;
+
+	accel_cache_header header{};
+	if (file.size < sizeof(header))
+	{
+		file.close();
+		return false;
+	}
+	memcpy(&header, file.data, sizeof(header));
+
+	if (memcmp(header.magic, ACCEL_CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+		header.version != ACCEL_CACHE_VERSION ||
+		header.key != key ||
+		header.sphere_count != sphere_count ||
+		header.bounded_count > header.sphere_count ||
+		header.soa_count < header.sphere_count)
+	{
+		file.close();
+		return false;
+	}
+
+	accel_view self{};
+	self.sphere_count = header.sphere_count;
+	self.bounded_count = header.bounded_count;
+	self.soa_count = header.soa_count;
+	self.node_count = header.node_count;
+	self.wide_width = header.wide_width;
+	self.wide_node_count = header.wide_node_count;
+	self.quantized_node_count = header.quantized_node_count;
+
+	const void* data[ACCEL_CACHE_SECTION_COUNT];
+	uint64_t size[ACCEL_CACHE_SECTION_COUNT];
+	_accel_cache_sections(self, data, size);
+	for (int s = 0; s < ACCEL_CACHE_SECTION_COUNT; ++s)
+	{
+		if (header.offsets[s] % ACCEL_CACHE_ALIGNMENT != 0 || header.offsets[s] + size[s] > file.size)
+		{
+			file.close();
+			return false;
+		}
+	}
+
+	auto base = file.data;
+	self.center_x = (const real_t*)(base + header.offsets[ACCEL_CACHE_CENTER_X]);
+	self.center_y = (const real_t*)(base + header.offsets[ACCEL_CACHE_CENTER_Y]);
+	self.center_z = (const real_t*)(base + header.offsets[ACCEL_CACHE_CENTER_Z]);
+	self.radius = (const real_t*)(base + header.offsets[ACCEL_CACHE_RADIUS]);
+	self.mat_index = (const int*)(base + header.offsets[ACCEL_CACHE_MAT_INDEX]);
+	self.nodes = (const bvh_node*)(base + header.offsets[ACCEL_CACHE_NODES]);
+	self.wide_min_x = (const float*)(base + header.offsets[ACCEL_CACHE_WIDE_MIN_X]);
+	self.wide_min_y = (const float*)(base + header.offsets[ACCEL_CACHE_WIDE_MIN_Y]);
+	self.wide_min_z = (const float*)(base + header.offsets[ACCEL_CACHE_WIDE_MIN_Z]);
+	self.wide_max_x = (const float*)(base + header.offsets[ACCEL_CACHE_WIDE_MAX_X]);
+	self.wide_max_y = (const float*)(base + header.offsets[ACCEL_CACHE_WIDE_MAX_Y]);
+	self.wide_max_z = (const float*)(base + header.offsets[ACCEL_CACHE_WIDE_MAX_Z]);
+	self.wide_child = (const int*)(base + header.offsets[ACCEL_CACHE_WIDE_CHILD]);
+	self.wide_count = (const int*)(base + header.offsets[ACCEL_CACHE_WIDE_COUNT]);
+	self.quantized_nodes = (const bvhq_node*)(base + header.offsets[ACCEL_CACHE_QUANTIZED_NODES]);
+
+	view = self;
+	return true;
+}
@@ -0,0 +1,323 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "aabb.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+constexpr int BVH_BIN_COUNT = 16;
+constexpr int BVH_MAX_LEAF_SIZE = 8;
+// traversal stack of the binary bvh, pushing both children of an inner node at depth d
+// needs d + 2 entries so the builders keep inner nodes above depth BVH_STACK_SIZE - 2
+constexpr int BVH_STACK_SIZE = 64;
+constexpr uint32_t BVH_MIN_RANGE = 1024;
+
+// 32 bytes, two nodes per cache line, the children of an internal node are always
+// stored next to each other (left_first and left_first + 1)
+struct bvh_node
+{
+	float bmin[3];
+	// internal node: index of the left child, leaf: index of the first primitive
+	int left_first;
+	float bmax[3];
+	// number of primitives in the leaf, 0 for internal nodes
+	int count;
+
+	bool is_leaf() const { return count > 0; }
+
+	void set_bounds(const aabb& b)
+	{
+		bmin[0] = b.min.x(); bmin[1] = b.min.y(); bmin[2] = b.min.z();
+		bmax[0] = b.max.x(); bmax[1] = b.max.y(); bmax[2] = b.max.z();
+	}
+
+	aabb bounds() const
+	{
+		return aabb{point3{bmin[0], bmin[1], bmin[2]}, point3{bmax[0], bmax[1], bmax[2]}};
+	}
+};
+
+struct bvh
+{
+	std::vector<bvh_node> nodes;
+	// primitives are referenced by the leaves through this permutation
+	std::vector<int> prim_indices;
+};
+
+struct _bvh_bin
+{
+	aabb bounds;
+	int count;
+};
+
+// ray/box slab test, returns the entry distance or infinity if the box is missed
+inline static real_t
+bvh_node_intersect(const bvh_node& node, const float origin[3], const float inv_dir[3], real_t t_min, real_t t_max)
+{
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		auto t0 = (node.bmin[axis] - origin[axis]) * inv_dir[axis];
+		auto t1 = (node.bmax[axis] - origin[axis]) * inv_dir[axis];
+		if (t0 > t1) { auto tmp = t0; t0 = t1; t1 = tmp; }
+		t_min = t0 > t_min ? t0 : t_min;
+		t_max = t1 < t_max ? t1 : t_max;
+	}
+	if (t_min > t_max)
+		return infinity;
+	return t_min;
+}
+
+// the nodes are summed in blocks of BVH_MIN_RANGE in parallel then the blocks in order, so
+// the cost doesn't depend on the thread count
+inline static real_t
+bvh_sah_cost(enki::TaskScheduler* ts, const bvh& self)
+{
+	if (self.nodes.empty())
+		return 0;
+
+	auto root_area = self.nodes[0].bounds().surface_area();
+	if (root_area <= 0)
+		return 0;
+
+	auto node_count = uint32_t(self.nodes.size());
+	auto block_count = (node_count + BVH_MIN_RANGE - 1) / BVH_MIN_RANGE;
+	std::vector<real_t> block_costs(block_count);
+	parallel_for(ts, block_count, 1, [&](uint32_t start, uint32_t end, uint32_t) {
+		for (auto block = start; block < end; ++block)
+		{
+			real_t block_cost = 0;
+			auto last = std::min(node_count, (block + 1) * BVH_MIN_RANGE);
+			for (auto i = block * BVH_MIN_RANGE; i < last; ++i)
+			{
+				const auto& node = self.nodes[i];
+				auto area = node.bounds().surface_area() / root_area;
+				if (node.is_leaf())
+					block_cost += area * node.count;
+				else
+					block_cost += area;
+			}
+			block_costs[block] = block_cost;
+		}
+	});
+
+	real_t cost = 0;
+	for (auto block_cost: block_costs)
+		cost += block_cost;
+	return cost;
+}
+
+// top down builder, every node is split at the best of BVH_BIN_COUNT candidate planes
+// per axis according to the surface area heuristic, the traversal and intersection
+// costs are both taken as 1 so a leaf of N primitives costs N, the nodes that reach
+// depth BVH_STACK_SIZE - 1 are left as leaves so the traversal stacks can't overflow
+inline static bvh
+bvh_build_binned_sah(const std::vector<aabb>& prim_bounds, int max_leaf_size = BVH_MAX_LEAF_SIZE)
+{
+	bvh self{};
+
+	auto prim_count = prim_bounds.size();
+	if (prim_count == 0)
+		return self;
+
+	std::vector<point3> centroids(prim_count);
+	self.prim_indices.resize(prim_count);
+	for (size_t i = 0; i < prim_count; ++i)
+	{
+		centroids[i] = prim_bounds[i].center();
+		self.prim_indices[i] = int(i);
+	}
+
+	self.nodes.reserve(2 * prim_count);
+	bvh_node root{};
+	root.left_first = 0;
+	root.count = int(prim_count);
+	self.nodes.push_back(root);
+
+	struct build_entry { int node_index; int depth; };
+	std::vector<build_entry> stack;
+	stack.push_back(build_entry{0, 0});
+
+	while (stack.empty() == false)
+	{
+		auto node_index = stack.back().node_index;
+		auto depth = stack.back().depth;
+		stack.pop_back();
+		auto first = self.nodes[node_index].left_first;
+		auto count = self.nodes[node_index].count;
+
+		aabb bounds{}, centroid_bounds{};
+		for (int i = first; i < first + count; ++i)
+		{
+			bounds.expand(prim_bounds[self.prim_indices[i]]);
+			centroid_bounds.expand(centroids[self.prim_indices[i]]);
+		}
+		self.nodes[node_index].set_bounds(bounds);
+
+		if (count <= 2 || depth >= BVH_STACK_SIZE - 1)
+			continue;
+
+		// find the cheapest split plane
+		int best_axis = -1;
+		int best_split = 0;
+		real_t best_cost = infinity;
+		auto centroid_extent = centroid_bounds.extent();
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			auto axis_min = centroid_bounds.min[axis];
+			auto axis_extent = centroid_extent[axis];
+			if (axis_extent <= 0)
+				continue;
+
+			_bvh_bin bins[BVH_BIN_COUNT]{};
+			auto scale = BVH_BIN_COUNT / axis_extent;
+			for (int i = first; i < first + count; ++i)
+			{
+				auto prim = self.prim_indices[i];
+				auto b = int((centroids[prim][axis] - axis_min) * scale);
+				if (b > BVH_BIN_COUNT - 1) b = BVH_BIN_COUNT - 1;
+				bins[b].count++;
+				bins[b].bounds.expand(prim_bounds[prim]);
+			}
+
+			// sweep from the right to get the right side areas then from the left to evaluate each plane
+			real_t right_area[BVH_BIN_COUNT - 1];
+			int right_count[BVH_BIN_COUNT - 1];
+			aabb right_bounds{};
+			int right_sum = 0;
+			for (int b = BVH_BIN_COUNT - 1; b > 0; --b)
+			{
+				right_bounds.expand(bins[b].bounds);
+				right_sum += bins[b].count;
+				right_area[b - 1] = right_bounds.surface_area();
+				right_count[b - 1] = right_sum;
+			}
+
+			aabb left_bounds{};
+			int left_sum = 0;
+			for (int b = 0; b < BVH_BIN_COUNT - 1; ++b)
+			{
+				left_bounds.expand(bins[b].bounds);
+				left_sum += bins[b].count;
+				if (left_sum == 0 || right_count[b] == 0)
+					continue;
+				auto cost = left_bounds.surface_area() * left_sum + right_area[b] * right_count[b];
+				if (cost < best_cost)
+				{
+					best_cost = cost;
+					best_axis = axis;
+					best_split = b;
+				}
+			}
+		}
+
+		int mid = first;
+		if (best_axis != -1)
+		{
+			auto leaf_cost = real_t(count);
+			auto split_cost = 1 + best_cost / bounds.surface_area();
+			if (count <= max_leaf_size && split_cost >= leaf_cost)
+				continue;
+
+			auto axis_min = centroid_bounds.min[best_axis];
+			auto scale = BVH_BIN_COUNT / centroid_extent[best_axis];
+			int j = first + count - 1;
+			mid = first;
+			while (mid <= j)
+			{
+				auto b = int((centroids[self.prim_indices[mid]][best_axis] - axis_min) * scale);
+				if (b > BVH_BIN_COUNT - 1) b = BVH_BIN_COUNT - 1;
+				if (b <= best_split)
+				{
+					++mid;
+				}
+				else
+				{
+					auto tmp = self.prim_indices[mid];
+					self.prim_indices[mid] = self.prim_indices[j];
+					self.prim_indices[j] = tmp;
+					--j;
+				}
+			}
+		}
+		else
+		{
+			// all the centroids are in the same spot, a split can't separate them
+			if (count <= max_leaf_size)
+				continue;
+			mid = first + count / 2;
+		}
+
+		auto left_index = int(self.nodes.size());
+		bvh_node left{};
+		left.left_first = first;
+		left.count = mid - first;
+		bvh_node right{};
+		right.left_first = mid;
+		right.count = first + count - mid;
+		self.nodes.push_back(left);
+		self.nodes.push_back(right);
+
+		self.nodes[node_index].left_first = left_index;
+		self.nodes[node_index].count = 0;
+
+		stack.push_back(build_entry{left_index + 1, depth + 1});
+		stack.push_back(build_entry{left_index, depth + 1});
+	}
+
+	return self;
+}
+
+// recomputes the bounds of every node after the primitives moved while keeping the topology,
+// the leaves are refitted in parallel and every inner node is computed by whichever of its
+// two children finishes last
+inline static void
+bvh_refit(enki::TaskScheduler* ts, bvh& self, const std::vector<aabb>& prim_bounds)
+{
+	auto node_count = uint32_t(self.nodes.size());
+	if (node_count == 0)
+		return;
+
+	std::vector<int> parents(node_count);
+	parents[0] = -1;
+	parallel_for(ts, node_count, BVH_MIN_RANGE, [&](uint32_t start, uint32_t end, uint32_t) {
+		for (auto i = start; i < end; ++i)
+		{
+			const auto& node = self.nodes[i];
+			if (node.is_leaf())
+				continue;
+			parents[node.left_first] = int(i);
+			parents[node.left_first + 1] = int(i);
+		}
+	});
+
+	std::vector<std::atomic<uint32_t>> visits(node_count);
+	parallel_for(ts, node_count, BVH_MIN_RANGE, [&](uint32_t start, uint32_t end, uint32_t) {
+		for (auto i = start; i < end; ++i)
+		{
+			auto& node = self.nodes[i];
+			if (node.is_leaf() == false)
+				continue;
+
+			aabb b{};
+			for (int j = node.left_first; j < node.left_first + node.count; ++j)
+				b.expand(prim_bounds[self.prim_indices[j]]);
+			node.set_bounds(b);
+
+			auto p = parents[i];
+			while (p != -1)
+			{
+				if (visits[p].fetch_add(1, std::memory_order_acq_rel) == 0)
+					break;
+
+				auto& parent = self.nodes[p];
+				auto parent_bounds = self.nodes[parent.left_first].bounds();
+				parent_bounds.expand(self.nodes[parent.left_first + 1].bounds());
+				parent.set_bounds(parent_bounds);
+				p = parents[p];
+			}
+		}
+	});
+}
@@ -0,0 +1,164 @@
+#pragma once
+
+#include "bvh_wide.h"
+
+#include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <vector>
+
+constexpr int BVHQ_WIDTH = 8;
+
+// 8 wide node with the child bounds stored as 8 bit offsets inside the node box,
+// a child bound decodes to origin + q * scale, must match BVHQNode in bvh_hit.ispc
+struct alignas(64) bvhq_node
+{
+	float origin[3];
+	float scale[3];
+	uint8_t qmin_x[BVHQ_WIDTH];
+	uint8_t qmin_y[BVHQ_WIDTH];
+	uint8_t qmin_z[BVHQ_WIDTH];
+	uint8_t qmax_x[BVHQ_WIDTH];
+	uint8_t qmax_y[BVHQ_WIDTH];
+	uint8_t qmax_z[BVHQ_WIDTH];
+	// inner child: index of the child node, leaf: index of the first primitive, -1 for empty slots
+	int child[BVHQ_WIDTH];
+	// number of primitives in a leaf, 0 for inner children and empty slots, a leaf can't hold
+	// more than 255 which only the depth capped leaves of the sah builder could reach
+	uint8_t count[BVHQ_WIDTH];
+	uint8_t padding[16];
+};
+static_assert(sizeof(bvhq_node) == 128, "bvhq_node should span exactly two cache lines");
+
+struct bvh_quantized
+{
+	std::vector<bvhq_node> nodes;
+	// binary node each slot was collapsed from, -1 for empty slots
+	std::vector<int> source;
+
+	size_t memory_size() const
+	{
+		return nodes.size() * sizeof(bvhq_node);
+	}
+};
+
+// largest q whose decoded value is still <= v
+inline static uint8_t
+_bvhq_quantize_min(real_t v, real_t origin, real_t scale)
+{
+	auto q = int(floor((v - origin) / scale));
+	if (q < 0) q = 0;
+	if (q > 255) q = 255;
+	while (q > 0 && origin + real_t(q) * scale > v)
+		--q;
+	return uint8_t(q);
+}
+
+// smallest q whose decoded value is still >= v
+inline static uint8_t
+_bvhq_quantize_max(real_t v, real_t origin, real_t scale)
+{
+	auto q = int(ceil((v - origin) / scale));
+	if (q < 0) q = 0;
+	if (q > 255) q = 255;
+	while (q < 255 && origin + real_t(q) * scale < v)
+		++q;
+	return uint8_t(q);
+}
+
+// quantizes the child bounds of node inside the box around all of them, the children of
+// the node have to be set already, empty slots get an inverted box
+inline static void
+_bvhq_set_bounds(bvhq_node& node, const aabb child_bounds[BVHQ_WIDTH])
+{
+	aabb bounds{};
+	for (int c = 0; c < BVHQ_WIDTH; ++c)
+		if (node.child[c] != -1)
+			bounds.expand(child_bounds[c]);
+
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		node.origin[axis] = bounds.min[axis];
+		auto extent = bounds.max[axis] - bounds.min[axis];
+		// a little slack so that q = 255 reaches the far side of the box after rounding
+		node.scale[axis] = extent > 0 ? extent / 255 * real_t(1.0001) : real_t(1e-6);
+	}
+
+	for (int c = 0; c < BVHQ_WIDTH; ++c)
+	{
+		if (node.child[c] == -1)
+		{
+			node.qmin_x[c] = node.qmin_y[c] = node.qmin_z[c] = 255;
+			node.qmax_x[c] = node.qmax_y[c] = node.qmax_z[c] = 0;
+			continue;
+		}
+		const auto& b = child_bounds[c];
+		node.qmin_x[c] = _bvhq_quantize_min(b.min.x(), node.origin[0], node.scale[0]);
+		node.qmin_y[c] = _bvhq_quantize_min(b.min.y(), node.origin[1], node.scale[1]);
+		node.qmin_z[c] = _bvhq_quantize_min(b.min.z(), node.origin[2], node.scale[2]);
+		node.qmax_x[c] = _bvhq_quantize_max(b.max.x(), node.origin[0], node.scale[0]);
+		node.qmax_y[c] = _bvhq_quantize_max(b.max.y(), node.origin[1], node.scale[1]);
+		node.qmax_z[c] = _bvhq_quantize_max(b.max.z(), node.origin[2], node.scale[2]);
+	}
+}
+
+// quantizes the child bounds of a wide bvh of width at most BVHQ_WIDTH, the nodes keep
+// the same indices so the traversal order and leaves are the same as the source, every
+// node is quantized on its own so they're spread over the scheduler
+inline static bvh_quantized
+bvh_quantize(enki::TaskScheduler* ts, const bvh_wide& wide)
+{
+	bvh_quantized self{};
+	auto width = wide.width;
+	auto node_count = uint32_t(wide.node_count());
+	self.nodes.resize(node_count);
+	self.source.resize(size_t(node_count) * BVHQ_WIDTH, -1);
+
+	parallel_for(ts, node_count, BVH_WIDE_MIN_RANGE, [&](uint32_t start, uint32_t end, uint32_t) {
+		for (auto n = start; n < end; ++n)
+		{
+			auto& node = self.nodes[n];
+			node = bvhq_node{};
+
+			aabb child_bounds[BVHQ_WIDTH]{};
+			for (int c = 0; c < BVHQ_WIDTH; ++c)
+				node.child[c] = -1;
+			for (int c = 0; c < width; ++c)
+			{
+				auto slot = size_t(n) * width + c;
+				if (wide.child[slot] == -1)
+					continue;
+				node.child[c] = wide.child[slot];
+				assert(wide.count[slot] <= UINT8_MAX && "leaf too big for a quantized node");
+				node.count[c] = uint8_t(wide.count[slot]);
+				child_bounds[c] = aabb{
+					point3{wide.min_x[slot], wide.min_y[slot], wide.min_z[slot]},
+					point3{wide.max_x[slot], wide.max_y[slot], wide.max_z[slot]}};
+				self.source[size_t(n) * BVHQ_WIDTH + c] = wide.source[slot];
+			}
+			_bvhq_set_bounds(node, child_bounds);
+		}
+	});
+
+	return self;
+}
+
+// picks up the refitted bounds of the binary nodes the slots were collapsed from, every
+// node is quantized again inside the new box around its children, the topology stays
+inline static void
+bvh_quantized_refit(enki::TaskScheduler* ts, bvh_quantized& self, const bvh& tree)
+{
+	parallel_for(ts, uint32_t(self.nodes.size()), BVH_WIDE_MIN_RANGE, [&](uint32_t start, uint32_t end, uint32_t) {
+		for (auto n = start; n < end; ++n)
+		{
+			aabb child_bounds[BVHQ_WIDTH]{};
+			for (int c = 0; c < BVHQ_WIDTH; ++c)
+			{
+				auto source = self.source[size_t(n) * BVHQ_WIDTH + c];
+				if (source != -1)
+					child_bounds[c] = tree.nodes[source].bounds();
+			}
+			_bvhq_set_bounds(self.nodes[n], child_bounds);
+		}
+	});
+}
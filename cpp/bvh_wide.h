@@ -0,0 +1,182 @@
+#pragma once
+
+#include "bvh.h"
+
+#include <vector>
+
+constexpr int BVH_WIDE_MAX_WIDTH = 16;
+constexpr uint32_t BVH_WIDE_MIN_RANGE = 256;
+
+// n-ary bvh with the child bounds of every node stored in soa so that one ispc call
+// tests all of them, child slot c of node n lives at index n * width + c
+struct bvh_wide
+{
+	int width;
+	std::vector<float> min_x, min_y, min_z;
+	std::vector<float> max_x, max_y, max_z;
+	// inner child: index of the child node, leaf: index of the first primitive
+	std::vector<int> child;
+	// number of primitives in a leaf, 0 for inner children and empty slots
+	std::vector<int> count;
+	// binary node each slot was collapsed from, used to refit the bounds
+	std::vector<int> source;
+
+	size_t node_count() const { return width ? child.size() / width : 0; }
+
+	// size of the arrays read by the traversal
+	size_t memory_size() const
+	{
+		return child.size() * (6 * sizeof(float) + 2 * sizeof(int));
+	}
+
+	// grows the arrays to hold node_count nodes, the new slots are empty
+	void resize(size_t node_count)
+	{
+		auto slots = node_count * width;
+		// empty slots have a child of -1 and are skipped by the traversal, their box can't
+		// be made to miss every ray since the slab test swaps the planes of each axis
+		min_x.resize(slots, infinity); min_y.resize(slots, infinity); min_z.resize(slots, infinity);
+		max_x.resize(slots, infinity); max_y.resize(slots, infinity); max_z.resize(slots, infinity);
+		child.resize(slots, -1);
+		count.resize(slots, 0);
+		source.resize(slots, -1);
+	}
+
+	void set_slot(int slot, const bvh_node& node)
+	{
+		min_x[slot] = node.bmin[0]; min_y[slot] = node.bmin[1]; min_z[slot] = node.bmin[2];
+		max_x[slot] = node.bmax[0]; max_y[slot] = node.bmax[1]; max_z[slot] = node.bmax[2];
+	}
+};
+
+// binary nodes that become the children of the wide node collapsed from binary_node, the
+// descendants with the largest surface area are pulled up until the slots are full
+inline static int
+_bvh_wide_pick_children(const bvh_node* nodes, int binary_node, int width, int children[])
+{
+	int children_count = 0;
+	const auto& root = nodes[binary_node];
+	if (root.is_leaf())
+	{
+		children[children_count++] = binary_node;
+		return children_count;
+	}
+
+	// the area of every child is computed once, leaves get -1 so they're never opened
+	real_t areas[BVH_WIDE_MAX_WIDTH];
+	auto set_child = [&](int i, int node) {
+		children[i] = node;
+		areas[i] = nodes[node].is_leaf() ? real_t(-1) : nodes[node].bounds().surface_area();
+	};
+	set_child(children_count++, root.left_first);
+	set_child(children_count++, root.left_first + 1);
+	while (children_count < width)
+	{
+		int best = -1;
+		real_t best_area = -1;
+		for (int i = 0; i < children_count; ++i)
+		{
+			if (areas[i] > best_area)
+			{
+				best_area = areas[i];
+				best = i;
+			}
+		}
+		if (best == -1)
+			break;
+
+		auto left = nodes[children[best]].left_first;
+		set_child(best, left);
+		set_child(children_count++, left + 1);
+	}
+	return children_count;
+}
+
+// collapses a binary bvh into a width-ary one a level at a time, the children of every
+// node of a level are picked in parallel then numbered after the level in the order of
+// their parents, so the nodes end up in breadth first order
+inline static bvh_wide
+bvh_wide_collapse(enki::TaskScheduler* ts, const bvh_node* nodes, size_t node_count, int width)
+{
+	bvh_wide self{};
+	self.width = width;
+	if (node_count == 0)
+		return self;
+
+	// level[i] is the binary node the wide node level_first + i is collapsed from
+	std::vector<int> level{0}, next_level;
+	std::vector<int> children;
+	std::vector<uint32_t> inner_first;
+	size_t level_first = 0;
+	self.resize(1);
+
+	while (level.empty() == false)
+	{
+		auto level_count = uint32_t(level.size());
+		children.assign(size_t(level_count) * width, -1);
+		inner_first.resize(level_count + 1);
+		parallel_for(ts, level_count, BVH_WIDE_MIN_RANGE, [&](uint32_t start, uint32_t end, uint32_t) {
+			for (auto i = start; i < end; ++i)
+			{
+				auto picked = &children[size_t(i) * width];
+				auto picked_count = _bvh_wide_pick_children(nodes, level[i], width, picked);
+				uint32_t inner_count = 0;
+				for (int c = 0; c < picked_count; ++c)
+					if (nodes[picked[c]].is_leaf() == false)
+						++inner_count;
+				inner_first[i + 1] = inner_count;
+			}
+		});
+
+		inner_first[0] = 0;
+		for (uint32_t i = 0; i < level_count; ++i)
+			inner_first[i + 1] += inner_first[i];
+		auto next_first = level_first + level_count;
+		self.resize(next_first + inner_first[level_count]);
+		next_level.resize(inner_first[level_count]);
+
+		parallel_for(ts, level_count, BVH_WIDE_MIN_RANGE, [&](uint32_t start, uint32_t end, uint32_t) {
+			for (auto i = start; i < end; ++i)
+			{
+				auto next = inner_first[i];
+				for (int c = 0; c < width; ++c)
+				{
+					auto binary_node = children[size_t(i) * width + c];
+					if (binary_node == -1)
+						break;
+
+					const auto& node = nodes[binary_node];
+					auto slot = int((level_first + i) * width + c);
+					self.set_slot(slot, node);
+					self.source[slot] = binary_node;
+					if (node.is_leaf())
+					{
+						self.child[slot] = node.left_first;
+						self.count[slot] = node.count;
+					}
+					else
+					{
+						self.child[slot] = int(next_first + next);
+						next_level[next++] = binary_node;
+					}
+				}
+			}
+		});
+
+		level_first = next_first;
+		level.swap(next_level);
+	}
+
+	return self;
+}
+
+// copies the bounds of a refitted binary bvh into the slots collapsed from it
+inline static void
+bvh_wide_refit(enki::TaskScheduler* ts, bvh_wide& self, const bvh& tree)
+{
+	parallel_for(ts, uint32_t(self.source.size()), BVH_MIN_RANGE, [&](uint32_t start, uint32_t end, uint32_t) {
+		for (auto slot = start; slot < end; ++slot)
+			if (self.source[slot] != -1)
+				self.set_slot(int(slot), tree.nodes[self.source[slot]]);
+	});
+}
@@ -1,6 +1,28 @@
 #pragma once
 
 #include "rtweekend.h"
+#include "random_simd.h"
+#include "sampler.h"
+
+#include <vector>
+
+// camera rays as soa arrays
+struct camera_ray_batch
+{
+	std::vector<real_t> origin_x, origin_y, origin_z;
+	std::vector<real_t> dir_x, dir_y, dir_z;
+
+	void resize(size_t size)
+	{
+		origin_x.resize(size); origin_y.resize(size); origin_z.resize(size);
+		dir_x.resize(size); dir_y.resize(size); dir_z.resize(size);
+	}
+
+	ray get_ray(size_t i) const
+	{
+		return ray{point3{origin_x[i], origin_y[i], origin_z[i]}, vec3{dir_x[i], dir_y[i], dir_z[i]}};
+	}
+};
 
 class camera
 {
@@ -26,13 +48,107 @@ public:
 
 	ray get_ray(random_series* series, real_t s, real_t t) const
 	{
-		auto rd = lens_radius * random_in_unit_disk(series);
-		auto offset = u * rd.x() + v * rd.y();
+		if (lens_radius == 0)
+			return ray{origin, lower_left_corner + s * horizontal + t * vertical - origin};
+
+		real_t disk_x, disk_y;
+		concentric_disk_sample(random_double(series), random_double(series), disk_x, disk_y);
+		auto offset = u * (lens_radius * disk_x) + v * (lens_radius * disk_y);
 
 		return ray{origin + offset, lower_left_corner + s * horizontal + t * vertical - origin - offset};
 	}
 
+	// camera rays of every pixel in [x0, x1) x [y0, y1) of an image_width x image_height
+	// image, samples_per_pixel each, sample s of pixel (x, y) goes to index
+	// ((y - y0) * (x1 - x0) + (x - x0)) * samples_per_pixel + s of the output arrays, a single
+	// random_float_x4 draw gives a ray both its pixel jitter and its lens sample
+	void get_rays(random_series_x4* series, int x0, int y0, int x1, int y1, int samples_per_pixel, int image_width, int image_height,
+		real_t* out_origin_x, real_t* out_origin_y, real_t* out_origin_z, real_t* out_dir_x, real_t* out_dir_y, real_t* out_dir_z) const
+	{
+		_get_rays(x0, y0, x1, y1, samples_per_pixel, image_width, image_height, out_origin_x, out_origin_y, out_origin_z, out_dir_x, out_dir_y, out_dir_z,
+			[series](int, int, int, real_t r[4]) { random_float_x4(series, r); });
+	}
+
+	void get_rays(random_series_x4* series, int x0, int y0, int x1, int y1, int samples_per_pixel, int image_width, int image_height, camera_ray_batch& out) const
+	{
+		out.resize(size_t(x1 - x0) * size_t(y1 - y0) * size_t(samples_per_pixel));
+		get_rays(series, x0, y0, x1, y1, samples_per_pixel, image_width, image_height,
+			out.origin_x.data(), out.origin_y.data(), out.origin_z.data(), out.dir_x.data(), out.dir_y.data(), out.dir_z.data());
+	}
+
+	// same as get_rays with the pixel jitter and the lens sample taken from the first
+	// SAMPLER_CAMERA_DIMENSIONS of the pixel's sobol sequence, sample s of pixel (x, y) is
+	// sample first_sample + s of the sequence so sobol_sampler(pixel, first_sample + s) goes on
+	// with the same point
+	void get_sobol_rays(uint32_t first_sample, int x0, int y0, int x1, int y1, int samples_per_pixel, int image_width, int image_height,
+		real_t* out_origin_x, real_t* out_origin_y, real_t* out_origin_z, real_t* out_dir_x, real_t* out_dir_y, real_t* out_dir_z) const
+	{
+		_get_rays(x0, y0, x1, y1, samples_per_pixel, image_width, image_height, out_origin_x, out_origin_y, out_origin_z, out_dir_x, out_dir_y, out_dir_z,
+			[&](int x, int y, int sample, real_t r[4]) {
+				auto seed = sampler_pixel_seed(uint32_t(y * image_width + x));
+				owen_sobol_2d(first_sample + uint32_t(sample), 0, seed, r[0], r[1]);
+				owen_sobol_2d(first_sample + uint32_t(sample), 1, seed, r[2], r[3]);
+			});
+	}
+
+	void get_sobol_rays(uint32_t first_sample, int x0, int y0, int x1, int y1, int samples_per_pixel, int image_width, int image_height, camera_ray_batch& out) const
+	{
+		out.resize(size_t(x1 - x0) * size_t(y1 - y0) * size_t(samples_per_pixel));
+		get_sobol_rays(first_sample, x0, y0, x1, y1, samples_per_pixel, image_width, image_height,
+			out.origin_x.data(), out.origin_y.data(), out.origin_z.data(), out.dir_x.data(), out.dir_y.data(), out.dir_z.data());
+	}
+
 private:
+	// draw(x, y, sample, r) fills r with the 4 numbers of a ray in [0, 1), the pixel jitter
+	// then the lens sample
+	template<typename F>
+	void _get_rays(int x0, int y0, int x1, int y1, int samples_per_pixel, int image_width, int image_height,
+		real_t* out_origin_x, real_t* out_origin_y, real_t* out_origin_z, real_t* out_dir_x, real_t* out_dir_y, real_t* out_dir_z, F&& draw) const
+	{
+		// the ray direction is corner + s * horizontal + t * vertical - offset with s and t
+		// the image coordinates and offset the lens sample
+		auto corner = lower_left_corner - origin;
+		auto inv_width = real_t(1) / real_t(image_width - 1);
+		auto inv_height = real_t(1) / real_t(image_height - 1);
+
+		size_t k = 0;
+		for (int y = y0; y < y1; ++y)
+		{
+			for (int x = x0; x < x1; ++x)
+			{
+				for (int sample = 0; sample < samples_per_pixel; ++sample, ++k)
+				{
+					real_t r[4];
+					draw(x, y, sample, r);
+					auto s = (real_t(x) + r[0]) * inv_width;
+					auto t = (real_t(y) + r[1]) * inv_height;
+					auto dir_x = corner.x() + s * horizontal.x() + t * vertical.x();
+					auto dir_y = corner.y() + s * horizontal.y() + t * vertical.y();
+					auto dir_z = corner.z() + s * horizontal.z() + t * vertical.z();
+
+					real_t offset_x = 0, offset_y = 0, offset_z = 0;
+					if (lens_radius != 0)
+					{
+						real_t disk_x, disk_y;
+						concentric_disk_sample(r[2], r[3], disk_x, disk_y);
+						disk_x *= lens_radius;
+						disk_y *= lens_radius;
+						offset_x = u.x() * disk_x + v.x() * disk_y;
+						offset_y = u.y() * disk_x + v.y() * disk_y;
+						offset_z = u.z() * disk_x + v.z() * disk_y;
+					}
+
+					out_origin_x[k] = origin.x() + offset_x;
+					out_origin_y[k] = origin.y() + offset_y;
+					out_origin_z[k] = origin.z() + offset_z;
+					out_dir_x[k] = dir_x - offset_x;
+					out_dir_y[k] = dir_y - offset_y;
+					out_dir_z[k] = dir_z - offset_z;
+				}
+			}
+		}
+	}
+
 	point3 origin;
 	point3 lower_left_corner;
 	vec3 horizontal;
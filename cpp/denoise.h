@@ -0,0 +1,170 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "hittable_list.h"
+#include "image.h"
+#include "material.h"
+#include "parallel.h"
+#include "atrous.h"
+
+#include <chrono>
+#include <stdint.h>
+#include <vector>
+
+// depth of the camera rays that miss everything, far enough that no hit is filtered with them
+constexpr real_t AOV_MISS_DEPTH = 1e6;
+// keeps the demodulation of black surfaces invertible
+constexpr real_t DENOISE_ALBEDO_EPSILON = 1e-3;
+constexpr uint32_t DENOISE_MIN_ROWS = 4;
+// samples a pixel needs for the variance of its own samples to be trusted, pixels with fewer
+// take it from the spread of the pixels around them
+constexpr int DENOISE_MIN_PIXEL_SAMPLES = 4;
+
+// aovs of a camera ray from its closest hit, a miss gets a white albedo so the sky goes through
+// the filter as it is and a normal facing the ray so it matches the misses next to it
+inline static aov_sample
+first_hit_aovs(const hittable_list& world, const ray& r, bool hit, const hit_record& rec)
+{
+	aov_sample self{};
+	auto length = r.direction().length();
+	if (hit == false)
+	{
+		self.albedo = color{1, 1, 1};
+		self.normal = -r.direction() / length;
+		self.depth = AOV_MISS_DEPTH;
+		return self;
+	}
+
+	const auto& mat = world.materials[rec.mat_index];
+	if (mat.kind == material::KIND_LAMBERTIAN || mat.kind == material::KIND_METAL)
+		self.albedo = mat.albedo;
+	else
+		self.albedo = color{1, 1, 1};
+	self.normal = rec.normal;
+	self.depth = rec.t * length;
+	return self;
+}
+
+// edge avoiding a-trous wavelet filter guided by the aovs (Dammertz et al.) with the weights
+// of svgf (Schied et al.), the image is divided by the albedo so the filter only blurs the
+// lighting and keeps the texture, then iterations passes of atrous.ispc with the taps twice
+// as far apart every pass cover about 2^(iterations + 2) pixels across, the luminance edges
+// are scaled by the variance of the mean of every pixel from the moments of its samples
+struct atrous_denoiser
+{
+	atrous_denoiser(enki::TaskScheduler* t)
+		: ts(t)
+	{}
+
+	enki::TaskScheduler* ts;
+	int iterations = 5;
+	real_t sigma_luminance = 4;
+	real_t sigma_normal = 128;
+	real_t sigma_depth = 1;
+
+	// two layers the passes ping pong between
+	std::vector<float> r[2], g[2], b[2], variance[2];
+	std::vector<float> normal_x, normal_y, normal_z;
+	std::vector<float> depth, depth_gradient;
+
+	// filters the pixels of img in place, img needs its aovs, returns the elapsed time
+	real_t denoise(image& img)
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+
+		auto width = img.width, height = img.height;
+		auto pixel_count = size_t(width) * size_t(height);
+		for (int l = 0; l < 2; ++l)
+		{
+			r[l].resize(pixel_count); g[l].resize(pixel_count); b[l].resize(pixel_count);
+			variance[l].resize(pixel_count);
+		}
+		normal_x.resize(pixel_count); normal_y.resize(pixel_count); normal_z.resize(pixel_count);
+		depth.resize(pixel_count);
+		depth_gradient.resize(pixel_count);
+
+		// the pixels are gamma corrected, the filter works on the linear illumination
+		parallel_for(ts, uint32_t(height), DENOISE_MIN_ROWS, [&](uint32_t begin, uint32_t end, uint32_t) {
+			for (auto i = size_t(begin) * width; i < size_t(end) * width; ++i)
+			{
+				auto c = img.pixels[i] * img.pixels[i];
+				auto a = img.albedo[i] + color{DENOISE_ALBEDO_EPSILON, DENOISE_ALBEDO_EPSILON, DENOISE_ALBEDO_EPSILON};
+				r[0][i] = c.x() / a.x(); g[0][i] = c.y() / a.y(); b[0][i] = c.z() / a.z();
+
+				// averaging the camera rays of a silhouette pixel shortens its normal
+				auto n = img.normal[i];
+				auto length = n.length();
+				if (length > 0)
+					n = n / length;
+				normal_x[i] = n.x(); normal_y[i] = n.y(); normal_z[i] = n.z();
+				depth[i] = img.depth[i];
+			}
+		});
+
+		// the smaller one sided difference so that the pixels on either side of a silhouette
+		// keep the gradient of their own surface
+		parallel_for(ts, uint32_t(height), DENOISE_MIN_ROWS, [&](uint32_t begin, uint32_t end, uint32_t) {
+			for (auto y = int(begin); y < int(end); ++y)
+			{
+				for (int x = 0; x < width; ++x)
+				{
+					auto i = size_t(y) * width + x;
+					auto z = depth[i];
+					auto dx = std::min(x > 0 ? fabs(z - depth[i - 1]) : infinity, x + 1 < width ? fabs(depth[i + 1] - z) : infinity);
+					auto dy = std::min(y > 0 ? fabs(z - depth[i - width]) : infinity, y + 1 < height ? fabs(depth[i + width] - z) : infinity);
+					depth_gradient[i] = (dx < infinity ? dx : 0) + (dy < infinity ? dy : 0);
+				}
+			}
+		});
+
+		ispc::DenoiseGuides guides{normal_x.data(), normal_y.data(), normal_z.data(), depth.data(), depth_gradient.data()};
+		ispc::DenoiseLayer layers[2] = {
+			{r[0].data(), g[0].data(), b[0].data(), variance[0].data()},
+			{r[1].data(), g[1].data(), b[1].data(), variance[1].data()},
+		};
+		auto sampled = [&](size_t i) { return img.sample_count[i] >= DENOISE_MIN_PIXEL_SAMPLES; };
+		bool all_sampled = true;
+		for (size_t i = 0; i < pixel_count && all_sampled; ++i)
+			all_sampled = sampled(i);
+		if (all_sampled == false)
+		{
+			parallel_for(ts, uint32_t(height), DENOISE_MIN_ROWS, [&](uint32_t begin, uint32_t end, uint32_t) {
+				ispc::denoise_variance_rows(layers[0], width, height, int(begin), int(end));
+			});
+		}
+		// demodulated like the color, by the luminance of the albedo
+		parallel_for(ts, uint32_t(height), DENOISE_MIN_ROWS, [&](uint32_t begin, uint32_t end, uint32_t) {
+			for (auto i = size_t(begin) * width; i < size_t(end) * width; ++i)
+			{
+				if (sampled(i) == false)
+					continue;
+				auto a = luminance(img.albedo[i]) + DENOISE_ALBEDO_EPSILON;
+				variance[0][i] = float(img.luminance_variance(i) / (a * a));
+			}
+		});
+
+		int current = 0;
+		for (int iteration = 0; iteration < iterations; ++iteration)
+		{
+			auto& in = layers[current];
+			auto& out = layers[1 - current];
+			parallel_for(ts, uint32_t(height), DENOISE_MIN_ROWS, [&](uint32_t begin, uint32_t end, uint32_t) {
+				ispc::denoise_atrous_rows(in, out, guides, width, height, 1 << iteration,
+					sigma_luminance, sigma_normal, sigma_depth, int(begin), int(end));
+			});
+			current = 1 - current;
+		}
+
+		parallel_for(ts, uint32_t(height), DENOISE_MIN_ROWS, [&](uint32_t begin, uint32_t end, uint32_t) {
+			for (auto i = size_t(begin) * width; i < size_t(end) * width; ++i)
+			{
+				auto a = img.albedo[i] + color{DENOISE_ALBEDO_EPSILON, DENOISE_ALBEDO_EPSILON, DENOISE_ALBEDO_EPSILON};
+				auto c = color{r[current][i], g[current][i], b[current][i]} * a;
+				img.pixels[i] = sqrt(color{max(real_t(0), c.x()), max(real_t(0), c.y()), max(real_t(0), c.z())});
+			}
+		});
+
+		auto end = std::chrono::high_resolution_clock::now();
+		return std::chrono::duration<real_t, std::milli>(end - start).count();
+	}
+};
@@ -0,0 +1,233 @@
+#pragma once
+
+#include "aabb.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <math.h>
+#include <memory>
+#include <vector>
+
+// cells per sphere the resolution aims for
+constexpr real_t GRID_DENSITY = 2;
+constexpr int GRID_MAX_RES = 256;
+constexpr uint32_t GRID_MIN_RANGE = 1024;
+
+// uniform grid over spheres, the entries of cell c are [cell_start[c], cell_start[c + 1])
+// with c = (z * res[1] + y) * res[0] + x, a sphere overlapping several cells is copied into
+// each of them so that every cell is one contiguous soa range for the ispc kernel
+struct uniform_grid
+{
+	aabb bounds;
+	int res[3];
+	real_t cell_size[3];
+	std::vector<int> cell_start;
+	std::vector<real_t> center_x;
+	std::vector<real_t> center_y;
+	std::vector<real_t> center_z;
+	std::vector<real_t> radius;
+	// index of the entry's sphere in the soa arrays the grid was built from
+	std::vector<int> soa_index;
+
+	size_t cell_count() const { return cell_start.empty() ? 0 : cell_start.size() - 1; }
+
+	size_t memory_size() const
+	{
+		return cell_start.capacity() * sizeof(int) + soa_index.capacity() * (4 * sizeof(real_t) + sizeof(int));
+	}
+
+	int cell_index(int x, int y, int z) const
+	{
+		return (z * res[1] + y) * res[0] + x;
+	}
+
+	int cell_coord(real_t v, int axis) const
+	{
+		auto c = int((v - bounds.min[axis]) / cell_size[axis]);
+		return c < 0 ? 0 : (c >= res[axis] ? res[axis] - 1 : c);
+	}
+};
+
+// builds the grid in O(n), one parallel pass counts the entries of every cell and a second
+// one scatters the spheres into them, each cell is then sorted so the result doesn't
+// depend on the thread timing
+inline static uniform_grid
+uniform_grid_build(enki::TaskScheduler* ts, const real_t* center_x, const real_t* center_y, const real_t* center_z, const real_t* radius, uint32_t count)
+{
+	uniform_grid self{};
+	if (count == 0)
+		return self;
+
+	auto sphere_bounds = [&](uint32_t i) {
+		point3 center{center_x[i], center_y[i], center_z[i]};
+		return aabb{center - vec3{radius[i]}, center + vec3{radius[i]}};
+	};
+
+	std::vector<aabb> partial_bounds(parallel_thread_count(ts));
+	parallel_for(ts, count, GRID_MIN_RANGE, [&](uint32_t start, uint32_t end, uint32_t thread_ix) {
+		aabb b{};
+		for (auto i = start; i < end; ++i)
+			b.expand(sphere_bounds(i));
+		partial_bounds[thread_ix].expand(b);
+	});
+	for (const auto& b: partial_bounds)
+		self.bounds.expand(b);
+
+	// cubic cells sized so that there are about GRID_DENSITY cells per sphere, flat axes
+	// get a floor so the volume never reaches 0
+	auto extent = self.bounds.extent();
+	auto max_extent = std::max(extent.x(), std::max(extent.y(), extent.z()));
+	real_t volume = 1;
+	for (int axis = 0; axis < 3; ++axis)
+		volume *= std::max(extent[axis], max_extent * real_t(1e-3));
+	auto cells_per_unit = real_t(cbrt(GRID_DENSITY * real_t(count) / volume));
+	size_t cell_count = 1;
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		self.res[axis] = std::min(std::max(int(extent[axis] * cells_per_unit), 1), GRID_MAX_RES);
+		self.cell_size[axis] = std::max(extent[axis], max_extent * real_t(1e-3)) / real_t(self.res[axis]);
+		cell_count *= size_t(self.res[axis]);
+	}
+
+	auto for_each_cell = [&](uint32_t i, auto&& func) {
+		auto b = sphere_bounds(i);
+		int lo[3], hi[3];
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			lo[axis] = self.cell_coord(b.min[axis], axis);
+			hi[axis] = self.cell_coord(b.max[axis], axis);
+		}
+		for (int z = lo[2]; z <= hi[2]; ++z)
+			for (int y = lo[1]; y <= hi[1]; ++y)
+				for (int x = lo[0]; x <= hi[0]; ++x)
+					func(self.cell_index(x, y, z));
+	};
+
+	std::unique_ptr<std::atomic<int>[]> cursor{new std::atomic<int>[cell_count]};
+	for (size_t c = 0; c < cell_count; ++c)
+		cursor[c].store(0, std::memory_order_relaxed);
+
+	parallel_for(ts, count, GRID_MIN_RANGE, [&](uint32_t start, uint32_t end, uint32_t) {
+		for (auto i = start; i < end; ++i)
+			for_each_cell(i, [&](int c) { cursor[c].fetch_add(1, std::memory_order_relaxed); });
+	});
+
+	self.cell_start.resize(cell_count + 1);
+	int entry_count = 0;
+	for (size_t c = 0; c < cell_count; ++c)
+	{
+		self.cell_start[c] = entry_count;
+		entry_count += cursor[c].load(std::memory_order_relaxed);
+		cursor[c].store(self.cell_start[c], std::memory_order_relaxed);
+	}
+	self.cell_start[cell_count] = entry_count;
+
+	self.soa_index.resize(entry_count);
+	parallel_for(ts, count, GRID_MIN_RANGE, [&](uint32_t start, uint32_t end, uint32_t) {
+		for (auto i = start; i < end; ++i)
+			for_each_cell(i, [&](int c) { self.soa_index[cursor[c].fetch_add(1, std::memory_order_relaxed)] = int(i); });
+	});
+
+	parallel_for(ts, uint32_t(cell_count), GRID_MIN_RANGE, [&](uint32_t start, uint32_t end, uint32_t) {
+		for (auto c = start; c < end; ++c)
+			std::sort(self.soa_index.begin() + self.cell_start[c], self.soa_index.begin() + self.cell_start[c + 1]);
+	});
+
+	self.center_x.resize(entry_count);
+	self.center_y.resize(entry_count);
+	self.center_z.resize(entry_count);
+	self.radius.resize(entry_count);
+	parallel_for(ts, uint32_t(entry_count), GRID_MIN_RANGE, [&](uint32_t start, uint32_t end, uint32_t) {
+		for (auto e = start; e < end; ++e)
+		{
+			auto i = self.soa_index[e];
+			self.center_x[e] = center_x[i];
+			self.center_y[e] = center_y[i];
+			self.center_z[e] = center_z[i];
+			self.radius[e] = radius[i];
+		}
+	});
+
+	return self;
+}
+
+// state of a 3d dda walk along a ray through the grid cells (Amanatides and Woo)
+struct grid_walk
+{
+	int cell[3];
+	int step[3];
+	real_t t_next[3];
+	real_t t_delta[3];
+	// where the ray leaves the grid or t_max, whichever is first
+	real_t t_end;
+
+	// t at which the ray leaves the current cell
+	real_t cell_exit() const
+	{
+		return std::min(t_next[0], std::min(t_next[1], t_next[2]));
+	}
+};
+
+// clips the ray to the grid and finds its first cell, returns false if it misses the grid
+inline static bool
+grid_walk_begin(const uniform_grid& self, const float origin[3], const float dir[3], real_t t_min, real_t t_max, grid_walk& walk)
+{
+	real_t t_enter = t_min;
+	real_t t_exit = t_max;
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		auto inv_dir = 1 / dir[axis];
+		auto t0 = (self.bounds.min[axis] - origin[axis]) * inv_dir;
+		auto t1 = (self.bounds.max[axis] - origin[axis]) * inv_dir;
+		if (t0 > t1) std::swap(t0, t1);
+		t_enter = std::max(t_enter, t0);
+		t_exit = std::min(t_exit, t1);
+	}
+	if (t_enter > t_exit)
+		return false;
+
+	walk.t_end = t_exit;
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		walk.cell[axis] = self.cell_coord(origin[axis] + dir[axis] * t_enter, axis);
+		if (dir[axis] > 0)
+		{
+			walk.step[axis] = 1;
+			walk.t_delta[axis] = self.cell_size[axis] / dir[axis];
+			walk.t_next[axis] = (self.bounds.min[axis] + real_t(walk.cell[axis] + 1) * self.cell_size[axis] - origin[axis]) / dir[axis];
+		}
+		else if (dir[axis] < 0)
+		{
+			walk.step[axis] = -1;
+			walk.t_delta[axis] = -self.cell_size[axis] / dir[axis];
+			walk.t_next[axis] = (self.bounds.min[axis] + real_t(walk.cell[axis]) * self.cell_size[axis] - origin[axis]) / dir[axis];
+		}
+		else
+		{
+			walk.step[axis] = 0;
+			walk.t_delta[axis] = infinity;
+			walk.t_next[axis] = infinity;
+		}
+	}
+	return true;
+}
+
+// moves to the next cell along the ray, returns false once the ray leaves the grid or
+// passes t_max
+inline static bool
+grid_walk_step(const uniform_grid& self, grid_walk& walk, real_t t_max)
+{
+	int axis = 0;
+	if (walk.t_next[1] < walk.t_next[axis]) axis = 1;
+	if (walk.t_next[2] < walk.t_next[axis]) axis = 2;
+
+	if (walk.t_next[axis] > std::min(walk.t_end, t_max))
+		return false;
+
+	walk.cell[axis] += walk.step[axis];
+	if (walk.cell[axis] < 0 || walk.cell[axis] >= self.res[axis])
+		return false;
+	walk.t_next[axis] += walk.t_delta[axis];
+	return true;
+}
@@ -2,8 +2,22 @@
 
 #include "hittable.h"
 #include "sphere.h"
+#include "plane.h"
+#include "instance.h"
+#include "material.h"
+#include "light.h"
+#include "light_tree.h"
+#include "bvh.h"
+#include "bvh_wide.h"
+#include "bvh_quantized.h"
+#include "lbvh.h"
+#include "grid.h"
+#include "accel_cache.h"
+#include "parallel.h"
 #include "spheres_hit.h"
+#include "bvh_hit.h"
 
+#include <assert.h>
 #include <memory>
 #include <vector>
 
@@ -19,6 +33,13 @@ struct spheres_soa
 	std::vector<int> mat_index;
 };
 
+// a sphere whose box has more than this times the mean box area of the other spheres is
+// kept out of the acceleration structure, otherwise a ground sphere stretches the root
+// box and every node above it over the whole scene
+constexpr real_t HUGE_SPHERE_AREA_RATIO = 64;
+// largest packet closest_hit_packet takes, must match BVH_PACKET_MAX_SIZE in bvh_hit.ispc
+constexpr int RAY_PACKET_MAX_SIZE = 64;
+
 inline static size_t
 _round_up(size_t num, size_t factor)
 {
@@ -27,34 +48,442 @@ _round_up(size_t num, size_t factor)
 	return num + factor - 1 - (num + factor - 1) % factor;
 }
 
+inline static ispc::Ray
+_to_ispc_ray(const ray& r)
+{
+	ispc::Ray ispc_ray{};
+	ispc_ray.origin.v[0] = r.origin().x();
+	ispc_ray.origin.v[1] = r.origin().y();
+	ispc_ray.origin.v[2] = r.origin().z();
+	ispc_ray.dir.v[0] = r.direction().x();
+	ispc_ray.dir.v[1] = r.direction().y();
+	ispc_ray.dir.v[2] = r.direction().z();
+	return ispc_ray;
+}
+
 class hittable_list
 {
 public:
+	enum ACCEL
+	{
+		ACCEL_LINEAR,
+		ACCEL_BVH,
+		ACCEL_BVH_WIDE,
+		ACCEL_BVH_QUANTIZED,
+		ACCEL_GRID,
+	};
+
+	enum BUILDER
+	{
+		BUILDER_SAH,
+		BUILDER_LBVH,
+	};
+
+	// how next event estimation picks the light to sample
+	enum LIGHT_PICK
+	{
+		// every light is as likely
+		LIGHT_PICK_UNIFORM,
+		// walk emitter_tree by the importance of each side
+		LIGHT_PICK_TREE,
+	};
+
 	hittable_list() {}
 	hittable_list(const sphere& sphere) { add(sphere); }
 
 	void clear() { spheres.clear(); }
 	void add(const sphere& sphere) { spheres.push_back(sphere); }
 	int add(const material& material) { materials.push_back(material); return materials.size() - 1; }
+	void add(const instance& instance) { instances.push_back(instance); }
+	void add(const plane& plane) { planes.push_back(plane); }
 
-	void prepare_soa()
+	// registers a bottom level list that instances can reference, its materials are copied
+	// once into this list so the hits inside it resolve to materials of this list
+	int add(const shared_ptr<hittable_list>& blas)
 	{
-		size_t simd_count = _round_up(spheres.size(), 4);
-		soa.center_x.resize(simd_count, real_t(10000));
-		soa.center_y.resize(simd_count, real_t(10000));
-		soa.center_z.resize(simd_count, real_t(10000));
-		soa.radius.resize(simd_count, real_t(0));
-		soa.mat_index.resize(simd_count, INT_MAX);
-		for (size_t i = 0; i < spheres.size(); ++i)
+		assert(blas->planes.empty() && "planes are unbounded and can't be instanced");
+		blas_material_offset.push_back(int(materials.size()));
+		materials.insert(materials.end(), blas->materials.begin(), blas->materials.end());
+		blases.push_back(blas);
+		return blases.size() - 1;
+	}
+
+	// builds the bvh over the spheres and lays out the soa arrays in bvh leaf order
+	// so that every leaf is a contiguous range of spheres, then the nodes of the selected
+	// accelerator on top of it, the builders and the per sphere loops run on the scheduler
+	// if one is given
+	void prepare_soa(enki::TaskScheduler* ts = nullptr, BUILDER builder = BUILDER_SAH)
+	{
+		prepare_instances(ts, builder);
+		build_spheres(ts, builder);
+		gather_lights();
+	}
+
+	// same as prepare_soa but the spheres part is loaded from a cache file in dir keyed by
+	// a hash of the sphere and material data and of the nodes the accelerator needs, on a
+	// miss it's built and written there for the next run, returns true on a cache hit
+	bool prepare_cached(enki::TaskScheduler* ts, BUILDER builder, const char* dir)
+	{
+		prepare_instances(ts, builder);
+		gather_lights();
+
+		// the accelerators that only read the binary bvh share a file
+		auto nodes = accel == ACCEL_BVH_WIDE || accel == ACCEL_BVH_QUANTIZED ? accel : ACCEL_BVH;
+		auto key = accel_cache_key(ts, spheres, materials, uint32_t(builder), uint32_t(nodes));
+		auto path = accel_cache_path(dir, key);
+		auto file = make_shared<mapped_file>();
+		accel_view mapped{};
+		if (accel_cache_load(*file, path.c_str(), key, uint32_t(spheres.size()), mapped))
+		{
+			tree = bvh{};
+			wide_tree = bvh_wide{};
+			quantized_tree = bvh_quantized{};
+			soa = spheres_soa{};
+			grid = uniform_grid{};
+			build_sah_cost = 0;
+			cache = file;
+			cache_view = mapped;
+			build_accel(ts);
+			return true;
+		}
+
+		build_spheres(ts, builder);
+		if (accel_cache_save(path.c_str(), key, view()) == false)
+			std::cerr << "failed to write the accel cache '" << path << "'" << std::endl;
+		return false;
+	}
+
+	// the arrays the traversal reads, owned by this list or mapped from a cache file
+	// the nodes built on first use by build_accel are owned by the list on top of a cache too,
+	// it's cached by build_accel and update since the traversal reads it several times a ray
+	const accel_view& view() const { return current_view; }
+
+	accel_view make_view() const
+	{
+		accel_view self{};
+		if (cache)
+		{
+			self = cache_view;
+		}
+		else
+		{
+			self.center_x = soa.center_x.data();
+			self.center_y = soa.center_y.data();
+			self.center_z = soa.center_z.data();
+			self.radius = soa.radius.data();
+			self.mat_index = soa.mat_index.data();
+			self.sphere_count = uint32_t(spheres.size());
+			self.bounded_count = uint32_t(bounded_spheres.size());
+			self.soa_count = uint32_t(soa.center_x.size());
+			self.nodes = tree.nodes.data();
+			self.node_count = uint32_t(tree.nodes.size());
+		}
+
+		if (wide_tree.node_count() > 0)
+		{
+			self.wide_min_x = wide_tree.min_x.data();
+			self.wide_min_y = wide_tree.min_y.data();
+			self.wide_min_z = wide_tree.min_z.data();
+			self.wide_max_x = wide_tree.max_x.data();
+			self.wide_max_y = wide_tree.max_y.data();
+			self.wide_max_z = wide_tree.max_z.data();
+			self.wide_child = wide_tree.child.data();
+			self.wide_count = wide_tree.count.data();
+			self.wide_width = uint32_t(wide_tree.width);
+			self.wide_node_count = uint32_t(wide_tree.node_count());
+		}
+		if (quantized_tree.nodes.empty() == false)
+		{
+			self.quantized_nodes = quantized_tree.nodes.data();
+			self.quantized_node_count = uint32_t(quantized_tree.nodes.size());
+		}
+		return self;
+	}
+
+	// picks up moved sphere centers (an animation frame) keeping the bvh topology, the bounds
+	// are refitted bottom up and the bvh is only rebuilt once its sah cost grew past
+	// rebuild_threshold times the cost it had when it was built, returns true on rebuild,
+	// a refit only keeps the selected accelerator and refits it in place, a grid can't be
+	// refitted and is left for build_accel
+	bool update(enki::TaskScheduler* ts, BUILDER builder, real_t rebuild_threshold)
+	{
+		gather_lights();
+
+		// a mapped cache has no binary bvh to refit
+		if (cache)
+		{
+			cache.reset();
+			prepare_soa(ts, builder);
+			return true;
+		}
+
+		bvh_refit(ts, tree, sphere_bounds(ts));
+		if (bvh_sah_cost(ts, tree) > build_sah_cost * rebuild_threshold)
 		{
-			soa.center_x[i] = spheres[i].center.x();
-			soa.center_y[i] = spheres[i].center.y();
-			soa.center_z[i] = spheres[i].center.z();
-			soa.radius[i] = spheres[i].radius;
-			soa.mat_index[i] = spheres[i].mat_index;
+			prepare_soa(ts, builder);
+			return true;
+		}
+
+		if (accel == ACCEL_BVH_WIDE)
+			bvh_wide_refit(ts, wide_tree, tree);
+		else
+			wide_tree = bvh_wide{};
+		if (accel == ACCEL_BVH_QUANTIZED)
+			bvh_quantized_refit(ts, quantized_tree, tree);
+		else
+			quantized_tree = bvh_quantized{};
+		fill_soa(ts);
+		// the spheres move across the cells
+		grid = uniform_grid{};
+		current_view = make_view();
+		return false;
+	}
+
+	// builds the structures the selected accelerator traverses if they aren't there yet, on
+	// top of the binary bvh, the grid isn't part of the accel cache
+	void build_accel(enki::TaskScheduler* ts)
+	{
+		current_view = make_view();
+		const auto& v = view();
+		switch (accel)
+		{
+		case ACCEL_BVH_WIDE:
+			if (v.wide_node_count == 0)
+				wide_tree = bvh_wide_collapse(ts, v.nodes, v.node_count, wide_width());
+			break;
+		case ACCEL_BVH_QUANTIZED:
+			if (v.quantized_node_count == 0)
+				quantize(ts);
+			break;
+		case ACCEL_GRID:
+			if (grid.cell_count() == 0)
+				build_grid(ts);
+			break;
+		default:
+			break;
+		}
+		current_view = make_view();
+	}
+
+	// switches to another accelerator, building it on first use
+	void use_accel(enki::TaskScheduler* ts, ACCEL kind)
+	{
+		for (auto& blas: blases)
+			blas->use_accel(ts, kind);
+		accel = kind;
+		build_accel(ts);
+	}
+
+	// the width the dispatcher picked for the wide bvh, clamped to what the nodes can hold
+	static int wide_width()
+	{
+		int width = ispc::bvh_wide_width();
+		if (width < 2) width = 2;
+		if (width > BVH_WIDE_MAX_WIDTH) width = BVH_WIDE_MAX_WIDTH;
+		return width;
+	}
+
+	bool closest_hit(const ray& r, real_t t_min, real_t t_max, hit_record& rec) const
+	{
+		// the unbounded primitives go first, a hit on the ground shortens the ray before
+		// it enters the accelerator
+		bool hit_anything = hit_unbounded(r, t_min, t_max, rec);
+		if (hit_anything)
+			t_max = rec.t;
+
+		bool res = false;
+		switch (accel)
+		{
+		case ACCEL_LINEAR: res = hit_soa(r, t_min, t_max, rec); break;
+		case ACCEL_BVH: res = hit_bvh(r, t_min, t_max, rec); break;
+		case ACCEL_BVH_WIDE: res = hit_bvh_wide(r, t_min, t_max, rec); break;
+		case ACCEL_BVH_QUANTIZED: res = hit_bvh_quantized(r, t_min, t_max, rec); break;
+		case ACCEL_GRID: res = hit_grid(r, t_min, t_max, rec); break;
+		default: assert(false && "unreachable"); break;
+		}
+		if (res)
+		{
+			hit_anything = true;
+			t_max = rec.t;
+		}
+
+		if (instances.empty() == false && hit_instances(r, t_min, t_max, rec))
+			hit_anything = true;
+		return hit_anything;
+	}
+
+	// closest hits of a packet of coherent rays like the primary rays of a pixel block, the
+	// bounded spheres are intersected by one ispc call with the lanes spread across the rays
+	// then every ray goes through the unbounded primitives and the instances on its own, only
+	// the linear list and the binary bvh have a packet kernel, the other accelerators trace
+	// the rays of the packet one by one through their own traversal
+	void closest_hit_packet(const ray* rays, int count, real_t t_min, real_t t_max, bool hits[], hit_record recs[]) const
+	{
+		assert(count <= RAY_PACKET_MAX_SIZE);
+
+		const auto& v = view();
+		bool use_bvh = accel == ACCEL_BVH;
+		if ((accel != ACCEL_LINEAR && use_bvh == false) || (use_bvh && v.node_count == 0))
+		{
+			for (int i = 0; i < count; ++i)
+				hits[i] = closest_hit(rays[i], t_min, t_max, recs[i]);
+			return;
+		}
+
+		float origin_x[RAY_PACKET_MAX_SIZE], origin_y[RAY_PACKET_MAX_SIZE], origin_z[RAY_PACKET_MAX_SIZE];
+		float dir_x[RAY_PACKET_MAX_SIZE], dir_y[RAY_PACKET_MAX_SIZE], dir_z[RAY_PACKET_MAX_SIZE];
+		for (int i = 0; i < count; ++i)
+		{
+			origin_x[i] = rays[i].origin().x();
+			origin_y[i] = rays[i].origin().y();
+			origin_z[i] = rays[i].origin().z();
+			dir_x[i] = rays[i].direction().x();
+			dir_y[i] = rays[i].direction().y();
+			dir_z[i] = rays[i].direction().z();
+		}
+
+		float out_t[RAY_PACKET_MAX_SIZE];
+		int32_t out_hit_index[RAY_PACKET_MAX_SIZE];
+		if (use_bvh)
+		{
+			bvh_packet_hit(
+				reinterpret_cast<const ispc::BVHNode*>(v.nodes),
+				v.center_x, v.center_y, v.center_z, v.radius,
+				origin_x, origin_y, origin_z, dir_x, dir_y, dir_z, count,
+				t_min, t_max, out_t, out_hit_index
+			);
+		}
+		else
+		{
+			ispc::spheres_hit_packet(
+				v.center_x, v.center_y, v.center_z, v.radius, v.bounded_count,
+				origin_x, origin_y, origin_z, dir_x, dir_y, dir_z, count,
+				t_min, t_max, out_t, out_hit_index
+			);
+		}
+
+		for (int i = 0; i < count; ++i)
+		{
+			const auto& r = rays[i];
+			auto& rec = recs[i];
+			auto ray_t_max = t_max;
+			hits[i] = out_hit_index[i] != -1;
+			if (hits[i])
+			{
+				set_hit_record(r, out_t[i], out_hit_index[i], rec);
+				ray_t_max = rec.t;
+			}
+
+			if (hit_unbounded(r, t_min, ray_t_max, rec))
+			{
+				hits[i] = true;
+				ray_t_max = rec.t;
+			}
+
+			if (instances.empty() == false && hit_instances(r, t_min, ray_t_max, rec))
+				hits[i] = true;
 		}
 	}
 
+	// visibility query for shadow rays, true if anything is hit inside [t_min, t_max]
+	// the traversals return on the first hit instead of looking for the closest one
+	bool occluded(const ray& r, real_t t_min, real_t t_max) const
+	{
+		if (occluded_unbounded(r, t_min, t_max))
+			return true;
+
+		bool res = false;
+		switch (accel)
+		{
+		case ACCEL_LINEAR: res = occluded_soa(r, t_min, t_max); break;
+		case ACCEL_BVH: res = occluded_bvh(r, t_min, t_max); break;
+		case ACCEL_BVH_WIDE: res = occluded_bvh_wide(r, t_min, t_max); break;
+		case ACCEL_BVH_QUANTIZED: res = occluded_bvh_quantized(r, t_min, t_max); break;
+		case ACCEL_GRID: res = occluded_grid(r, t_min, t_max); break;
+		default: assert(false && "unreachable"); break;
+		}
+
+		if (res == false && instances.empty() == false)
+			res = occluded_instances(r, t_min, t_max);
+		return res;
+	}
+
+	// index in lights of the light rec hit, -1 for emissive spheres that aren't in lights
+	// (the ones inside instances), the lights of a material are few so they're just scanned
+	// for the one whose surface rec.p is on
+	int light_at(const hit_record& rec) const
+	{
+		auto first = light_first[rec.mat_index];
+		auto last = light_first[rec.mat_index + 1];
+		int res = -1;
+		real_t res_error = infinity;
+		for (auto i = first; i < last; ++i)
+		{
+			auto error = fabs((rec.p - lights[i].center).length() - lights[i].radius);
+			if (error < res_error)
+			{
+				res = int(i);
+				res_error = error;
+			}
+		}
+		return res;
+	}
+
+	aabb bounds() const
+	{
+		aabb self{};
+		const auto& v = view();
+		if (v.node_count > 0)
+			self.expand(v.nodes[0].bounds());
+		if (instance_tree.nodes.empty() == false)
+			self.expand(instance_tree.nodes[0].bounds());
+		return self;
+	}
+
+	// size of the nodes read by the traversal of the given accelerator
+	size_t accel_memory_size(ACCEL kind) const
+	{
+		const auto& v = view();
+		size_t self = 0;
+		switch (kind)
+		{
+		case ACCEL_LINEAR: break;
+		case ACCEL_BVH: self = v.node_count * sizeof(bvh_node); break;
+		case ACCEL_BVH_WIDE: self = size_t(v.wide_node_count) * v.wide_width * (6 * sizeof(float) + 2 * sizeof(int)); break;
+		case ACCEL_BVH_QUANTIZED: self = v.quantized_node_count * sizeof(bvhq_node); break;
+		case ACCEL_GRID: self = grid.memory_size(); break;
+		default: assert(false && "unreachable"); break;
+		}
+		for (const auto& blas: blases)
+			self += blas->accel_memory_size(kind);
+		return self;
+	}
+
+	// memory owned by this list including a mapped cache file, every bottom level list is
+	// counted once no matter how many instances reference it
+	size_t memory_size() const
+	{
+		auto self = spheres.capacity() * sizeof(sphere) +
+			materials.capacity() * sizeof(material) +
+			soa.center_x.capacity() * (4 * sizeof(real_t) + sizeof(int)) +
+			tree.nodes.capacity() * sizeof(bvh_node) +
+			tree.prim_indices.capacity() * sizeof(int) +
+			(bounded_spheres.capacity() + huge_spheres.capacity()) * sizeof(int) +
+			planes.capacity() * sizeof(plane) +
+			lights.capacity() * sizeof(sphere_light) +
+			emitter_tree.nodes.capacity() * (sizeof(light_tree_node) + sizeof(int)) +
+			wide_tree.memory_size() +
+			quantized_tree.memory_size() +
+			instances.capacity() * sizeof(instance) +
+			instance_tree.nodes.capacity() * sizeof(bvh_node) +
+			instance_tree.prim_indices.capacity() * sizeof(int) +
+			grid.memory_size() +
+			(cache ? cache->size : 0);
+		for (const auto& blas: blases)
+			self += blas->memory_size();
+		return self;
+	}
+
 	bool hit(const ray& r, real_t t_min, real_t t_max, hit_record& rec) const
 	{
 		hit_record temp_rec;
@@ -71,28 +500,91 @@ public:
 			}
 		}
 
+		for (const auto& plane: planes)
+		{
+			if (plane.hit(r, t_min, closest_so_far, temp_rec))
+			{
+				hit_anything = true;
+				closest_so_far = temp_rec.t;
+				rec = temp_rec;
+			}
+		}
+
 		return hit_anything;
 	}
 
+	// the huge spheres sit after the bounded ones in the soa arrays and are tested with the
+	// same kernel, then the planes
+	bool hit_unbounded(const ray& r, real_t t_min, real_t t_max, hit_record& rec) const
+	{
+		bool hit_anything = false;
+		const auto& v = view();
+		auto first = v.bounded_count;
+		if (v.sphere_count > first)
+		{
+			float out_t{};
+			int32_t out_hit_index{};
+			auto res = spheres_hit(
+				v.center_x + first,
+				v.center_y + first,
+				v.center_z + first,
+				v.radius + first,
+				v.sphere_count - first,
+				_to_ispc_ray(r),
+				t_min,
+				t_max,
+				&out_t,
+				&out_hit_index
+			);
+
+			if (res)
+			{
+				set_hit_record(r, out_t, first + out_hit_index, rec);
+				hit_anything = true;
+				t_max = out_t;
+			}
+		}
+
+		for (const auto& plane: planes)
+		{
+			if (plane.hit(r, t_min, t_max, rec))
+			{
+				hit_anything = true;
+				t_max = rec.t;
+			}
+		}
+
+		return hit_anything;
+	}
+
+	bool occluded_unbounded(const ray& r, real_t t_min, real_t t_max) const
+	{
+		const auto& v = view();
+		auto first = v.bounded_count;
+		if (v.sphere_count > first && spheres_occluded(v.center_x + first, v.center_y + first, v.center_z + first, v.radius + first, v.sphere_count - first, _to_ispc_ray(r), t_min, t_max))
+			return true;
+
+		hit_record rec;
+		for (const auto& plane: planes)
+			if (plane.hit(r, t_min, t_max, rec))
+				return true;
+		return false;
+	}
+
 	bool hit_soa(const ray& r, real_t t_min, real_t t_max, hit_record& rec) const
 	{
-		ispc::Ray ispc_ray{};
-		ispc_ray.origin.v[0] = r.origin().x();
-		ispc_ray.origin.v[1] = r.origin().y();
-		ispc_ray.origin.v[2] = r.origin().z();
-		ispc_ray.dir.v[0] = r.direction().x();
-		ispc_ray.dir.v[1] = r.direction().y();
-		ispc_ray.dir.v[2] = r.direction().z();
+		const auto& v = view();
+		auto ispc_ray = _to_ispc_ray(r);
 
 		float out_t{};
 		int32_t out_hit_index{};
 
 		auto res = spheres_hit(
-			soa.center_x.data(),
-			soa.center_y.data(),
-			soa.center_z.data(),
-			soa.radius.data(),
-			spheres.size(),
+			v.center_x,
+			v.center_y,
+			v.center_z,
+			v.radius,
+			v.bounded_count,
 			ispc_ray,
 			t_min,
 			t_max,
@@ -103,16 +595,649 @@ public:
 		if (res == false)
 			return false;
 
-		rec.t = out_t;
-		rec.p = r.at(rec.t);
-		vec3 center {soa.center_x[out_hit_index], soa.center_y[out_hit_index], soa.center_z[out_hit_index]};
-		auto outward_normal = (rec.p - center) / soa.radius[out_hit_index];
-		rec.set_face_normal(r, outward_normal);
-		rec.mat_index = soa.mat_index[out_hit_index];
+		set_hit_record(r, out_t, out_hit_index, rec);
 		return res;
 	}
 
+	// closest hit through the bvh, the nodes are traversed in C++ nearest child first and
+	// the leaves are handed to the same ispc kernel as hit_soa
+	bool hit_bvh(const ray& r, real_t t_min, real_t t_max, hit_record& rec) const
+	{
+		const auto& v = view();
+		if (v.node_count == 0)
+			return false;
+
+		auto ispc_ray = _to_ispc_ray(r);
+		float inv_dir[3] = {1.0f / ispc_ray.dir.v[0], 1.0f / ispc_ray.dir.v[1], 1.0f / ispc_ray.dir.v[2]};
+
+		struct stack_entry { int node; real_t t; };
+		stack_entry stack[BVH_STACK_SIZE];
+		int stack_size = 0;
+
+		auto closest_so_far = t_max;
+		int hit_index = -1;
+
+		if (bvh_node_intersect(v.nodes[0], ispc_ray.origin.v, inv_dir, t_min, closest_so_far) == infinity)
+			return false;
+		stack[stack_size++] = stack_entry{0, t_min};
+
+		while (stack_size > 0)
+		{
+			auto entry = stack[--stack_size];
+			if (entry.t > closest_so_far)
+				continue;
+
+			const auto* node = &v.nodes[entry.node];
+			while (node->is_leaf() == false)
+			{
+				auto left_index = node->left_first;
+				auto right_index = left_index + 1;
+				auto t_left = bvh_node_intersect(v.nodes[left_index], ispc_ray.origin.v, inv_dir, t_min, closest_so_far);
+				auto t_right = bvh_node_intersect(v.nodes[right_index], ispc_ray.origin.v, inv_dir, t_min, closest_so_far);
+				if (t_left > t_right)
+				{
+					auto tmp = t_left; t_left = t_right; t_right = tmp;
+					auto tmp_index = left_index; left_index = right_index; right_index = tmp_index;
+				}
+
+				if (t_left == infinity)
+				{
+					node = nullptr;
+					break;
+				}
+
+				if (t_right != infinity)
+				{
+					assert(stack_size < BVH_STACK_SIZE);
+					stack[stack_size++] = stack_entry{right_index, t_right};
+				}
+				node = &v.nodes[left_index];
+			}
+
+			if (node == nullptr)
+				continue;
+
+			float out_t{};
+			int32_t out_hit_index{};
+			auto first = node->left_first;
+			auto res = spheres_hit(
+				v.center_x + first,
+				v.center_y + first,
+				v.center_z + first,
+				v.radius + first,
+				node->count,
+				ispc_ray,
+				t_min,
+				closest_so_far,
+				&out_t,
+				&out_hit_index
+			);
+
+			if (res)
+			{
+				closest_so_far = out_t;
+				hit_index = first + out_hit_index;
+			}
+		}
+
+		if (hit_index == -1)
+			return false;
+
+		set_hit_record(r, closest_so_far, hit_index, rec);
+		return true;
+	}
+
+	// the whole traversal of the wide bvh runs inside one ispc call, each node visit
+	// tests all of its children at vector width
+	bool hit_bvh_wide(const ray& r, real_t t_min, real_t t_max, hit_record& rec) const
+	{
+		const auto& v = view();
+		if (v.wide_node_count == 0)
+			return false;
+
+		auto ispc_ray = _to_ispc_ray(r);
+
+		float out_t{};
+		int32_t out_hit_index{};
+
+		auto res = bvh_wide_hit(
+			v.wide_min_x,
+			v.wide_min_y,
+			v.wide_min_z,
+			v.wide_max_x,
+			v.wide_max_y,
+			v.wide_max_z,
+			v.wide_child,
+			v.wide_count,
+			int(v.wide_width),
+			v.center_x,
+			v.center_y,
+			v.center_z,
+			v.radius,
+			ispc_ray,
+			t_min,
+			t_max,
+			&out_t,
+			&out_hit_index
+		);
+
+		if (res == false)
+			return false;
+
+		set_hit_record(r, out_t, out_hit_index, rec);
+		return res;
+	}
+
+	// same traversal as hit_bvh_wide over 8 wide nodes with 8 bit child bounds
+	bool hit_bvh_quantized(const ray& r, real_t t_min, real_t t_max, hit_record& rec) const
+	{
+		const auto& v = view();
+		if (v.quantized_node_count == 0)
+			return false;
+
+		auto ispc_ray = _to_ispc_ray(r);
+
+		float out_t{};
+		int32_t out_hit_index{};
+
+		auto res = bvhq_hit(
+			reinterpret_cast<const ispc::BVHQNode*>(v.quantized_nodes),
+			v.center_x,
+			v.center_y,
+			v.center_z,
+			v.radius,
+			ispc_ray,
+			t_min,
+			t_max,
+			&out_t,
+			&out_hit_index
+		);
+
+		if (res == false)
+			return false;
+
+		set_hit_record(r, out_t, out_hit_index, rec);
+		return res;
+	}
+
+	// 3d dda through the grid cells along the ray, each cell is handed to the same ispc
+	// kernel as hit_soa, the walk stops once the closest hit lies inside the current cell
+	// since no later cell can hold anything closer
+	bool hit_grid(const ray& r, real_t t_min, real_t t_max, hit_record& rec) const
+	{
+		if (grid.cell_count() == 0)
+			return false;
+
+		auto ispc_ray = _to_ispc_ray(r);
+		grid_walk walk{};
+		if (grid_walk_begin(grid, ispc_ray.origin.v, ispc_ray.dir.v, t_min, t_max, walk) == false)
+			return false;
+
+		auto closest_so_far = t_max;
+		int hit_index = -1;
+		do
+		{
+			auto cell = grid.cell_index(walk.cell[0], walk.cell[1], walk.cell[2]);
+			auto first = grid.cell_start[cell];
+			auto count = grid.cell_start[cell + 1] - first;
+			if (count == 0)
+				continue;
+
+			float out_t{};
+			int32_t out_hit_index{};
+			auto res = spheres_hit(
+				grid.center_x.data() + first,
+				grid.center_y.data() + first,
+				grid.center_z.data() + first,
+				grid.radius.data() + first,
+				count,
+				ispc_ray,
+				t_min,
+				closest_so_far,
+				&out_t,
+				&out_hit_index
+			);
+
+			// a sphere overlapping several cells is found again in the next ones at the same t,
+			// only a strictly closer hit replaces the one already taken
+			if (res && (hit_index == -1 || out_t < closest_so_far))
+			{
+				closest_so_far = out_t;
+				hit_index = grid.soa_index[first + out_hit_index];
+			}
+
+			if (hit_index != -1 && closest_so_far <= walk.cell_exit())
+				break;
+		} while (grid_walk_step(grid, walk, closest_so_far));
+
+		if (hit_index == -1)
+			return false;
+
+		set_hit_record(r, closest_so_far, hit_index, rec);
+		return true;
+	}
+
+	// top level traversal in C++, every instance leaf moves the ray to the object space of
+	// its bottom level list and runs that list's own accelerator
+	bool hit_instances(const ray& r, real_t t_min, real_t t_max, hit_record& rec) const
+	{
+		if (instance_tree.nodes.empty())
+			return false;
+
+		auto ispc_ray = _to_ispc_ray(r);
+		float inv_dir[3] = {1.0f / ispc_ray.dir.v[0], 1.0f / ispc_ray.dir.v[1], 1.0f / ispc_ray.dir.v[2]};
+
+		int stack[BVH_STACK_SIZE];
+		int stack_size = 0;
+		stack[stack_size++] = 0;
+
+		auto closest_so_far = t_max;
+		int hit_instance = -1;
+		hit_record temp_rec;
+
+		while (stack_size > 0)
+		{
+			const auto& node = instance_tree.nodes[stack[--stack_size]];
+			if (bvh_node_intersect(node, ispc_ray.origin.v, inv_dir, t_min, closest_so_far) == infinity)
+				continue;
+
+			if (node.is_leaf() == false)
+			{
+				assert(stack_size + 2 <= BVH_STACK_SIZE);
+				stack[stack_size++] = node.left_first + 1;
+				stack[stack_size++] = node.left_first;
+				continue;
+			}
+
+			for (int i = node.left_first; i < node.left_first + node.count; ++i)
+			{
+				auto instance_index = instance_tree.prim_indices[i];
+				const auto& inst = instances[instance_index];
+				// the direction is left unnormalized so t is the same in both spaces
+				ray object_ray{inst.world_to_object.apply_point(r.origin()), inst.world_to_object.apply_vector(r.direction())};
+				if (blases[inst.blas]->closest_hit(object_ray, t_min, closest_so_far, temp_rec))
+				{
+					closest_so_far = temp_rec.t;
+					hit_instance = instance_index;
+					rec = temp_rec;
+				}
+			}
+		}
+
+		if (hit_instance == -1)
+			return false;
+
+		const auto& inst = instances[hit_instance];
+		auto outward_normal = rec.front_face ? rec.normal : -rec.normal;
+		rec.p = r.at(rec.t);
+		rec.set_face_normal(r, unit_vector(inst.world_to_object.apply_transposed(outward_normal)));
+		rec.mat_index += blas_material_offset[inst.blas];
+		return true;
+	}
+
+	bool occluded_soa(const ray& r, real_t t_min, real_t t_max) const
+	{
+		const auto& v = view();
+		return spheres_occluded(v.center_x, v.center_y, v.center_z, v.radius, v.bounded_count, _to_ispc_ray(r), t_min, t_max);
+	}
+
+	// any hit through the binary bvh, children are visited in memory order since there's
+	// no closest hit to shrink the ray against
+	bool occluded_bvh(const ray& r, real_t t_min, real_t t_max) const
+	{
+		const auto& v = view();
+		if (v.node_count == 0)
+			return false;
+
+		auto ispc_ray = _to_ispc_ray(r);
+		float inv_dir[3] = {1.0f / ispc_ray.dir.v[0], 1.0f / ispc_ray.dir.v[1], 1.0f / ispc_ray.dir.v[2]};
+
+		int stack[BVH_STACK_SIZE];
+		int stack_size = 0;
+		stack[stack_size++] = 0;
+
+		while (stack_size > 0)
+		{
+			const auto& node = v.nodes[stack[--stack_size]];
+			if (bvh_node_intersect(node, ispc_ray.origin.v, inv_dir, t_min, t_max) == infinity)
+				continue;
+
+			if (node.is_leaf() == false)
+			{
+				assert(stack_size + 2 <= BVH_STACK_SIZE);
+				stack[stack_size++] = node.left_first + 1;
+				stack[stack_size++] = node.left_first;
+				continue;
+			}
+
+			auto first = node.left_first;
+			if (spheres_occluded(v.center_x + first, v.center_y + first, v.center_z + first, v.radius + first, node.count, ispc_ray, t_min, t_max))
+				return true;
+		}
+
+		return false;
+	}
+
+	bool occluded_bvh_wide(const ray& r, real_t t_min, real_t t_max) const
+	{
+		const auto& v = view();
+		if (v.wide_node_count == 0)
+			return false;
+
+		return bvh_wide_occluded(
+			v.wide_min_x,
+			v.wide_min_y,
+			v.wide_min_z,
+			v.wide_max_x,
+			v.wide_max_y,
+			v.wide_max_z,
+			v.wide_child,
+			v.wide_count,
+			int(v.wide_width),
+			v.center_x,
+			v.center_y,
+			v.center_z,
+			v.radius,
+			_to_ispc_ray(r),
+			t_min,
+			t_max
+		);
+	}
+
+	bool occluded_bvh_quantized(const ray& r, real_t t_min, real_t t_max) const
+	{
+		const auto& v = view();
+		if (v.quantized_node_count == 0)
+			return false;
+
+		return bvhq_occluded(
+			reinterpret_cast<const ispc::BVHQNode*>(v.quantized_nodes),
+			v.center_x,
+			v.center_y,
+			v.center_z,
+			v.radius,
+			_to_ispc_ray(r),
+			t_min,
+			t_max
+		);
+	}
+
+	bool occluded_grid(const ray& r, real_t t_min, real_t t_max) const
+	{
+		if (grid.cell_count() == 0)
+			return false;
+
+		auto ispc_ray = _to_ispc_ray(r);
+		grid_walk walk{};
+		if (grid_walk_begin(grid, ispc_ray.origin.v, ispc_ray.dir.v, t_min, t_max, walk) == false)
+			return false;
+
+		do
+		{
+			auto cell = grid.cell_index(walk.cell[0], walk.cell[1], walk.cell[2]);
+			auto first = grid.cell_start[cell];
+			auto count = grid.cell_start[cell + 1] - first;
+			if (count > 0 && spheres_occluded(grid.center_x.data() + first, grid.center_y.data() + first, grid.center_z.data() + first, grid.radius.data() + first, count, ispc_ray, t_min, t_max))
+				return true;
+		} while (grid_walk_step(grid, walk, t_max));
+
+		return false;
+	}
+
+	bool occluded_instances(const ray& r, real_t t_min, real_t t_max) const
+	{
+		if (instance_tree.nodes.empty())
+			return false;
+
+		auto ispc_ray = _to_ispc_ray(r);
+		float inv_dir[3] = {1.0f / ispc_ray.dir.v[0], 1.0f / ispc_ray.dir.v[1], 1.0f / ispc_ray.dir.v[2]};
+
+		int stack[BVH_STACK_SIZE];
+		int stack_size = 0;
+		stack[stack_size++] = 0;
+
+		while (stack_size > 0)
+		{
+			const auto& node = instance_tree.nodes[stack[--stack_size]];
+			if (bvh_node_intersect(node, ispc_ray.origin.v, inv_dir, t_min, t_max) == infinity)
+				continue;
+
+			if (node.is_leaf() == false)
+			{
+				assert(stack_size + 2 <= BVH_STACK_SIZE);
+				stack[stack_size++] = node.left_first + 1;
+				stack[stack_size++] = node.left_first;
+				continue;
+			}
+
+			for (int i = node.left_first; i < node.left_first + node.count; ++i)
+			{
+				const auto& inst = instances[instance_tree.prim_indices[i]];
+				ray object_ray{inst.world_to_object.apply_point(r.origin()), inst.world_to_object.apply_vector(r.direction())};
+				if (blases[inst.blas]->occluded(object_ray, t_min, t_max))
+					return true;
+			}
+		}
+
+		return false;
+	}
+
 	std::vector<sphere> spheres;
 	std::vector<material> materials;
+	// the emissive spheres grouped by material, the ones of material m are
+	// lights[light_first[m], light_first[m + 1])
+	std::vector<sphere_light> lights;
+	std::vector<uint32_t> light_first;
+	light_tree emitter_tree;
+	LIGHT_PICK light_pick = LIGHT_PICK_TREE;
+	// scale of the sky gradient, scenes lit by their own lights turn it down
+	real_t sky_intensity = 1;
+	// unbounded primitives, tested on every ray outside of the accelerators
+	std::vector<plane> planes;
+	// indices of the spheres the accelerators are built over and of the huge ones next to
+	// them, the soa arrays hold the bounded spheres in bvh leaf order then the huge ones
+	std::vector<int> bounded_spheres;
+	std::vector<int> huge_spheres;
 	spheres_soa soa;
+	bvh tree;
+	bvh_wide wide_tree;
+	bvh_quantized quantized_tree;
+	uniform_grid grid;
+	// shared bottom level lists and the instances placing them in this list
+	std::vector<shared_ptr<hittable_list>> blases;
+	std::vector<int> blas_material_offset;
+	std::vector<instance> instances;
+	bvh instance_tree;
+	real_t build_sah_cost = 0;
+	// accelerator of the queries, set it before preparing the list or switch with use_accel
+	// afterwards so that its structures get built
+	ACCEL accel = ACCEL_BVH_WIDE;
+	// mapped accel cache file, when set the traversal reads cache_view instead of the vectors
+	shared_ptr<mapped_file> cache;
+	accel_view cache_view{};
+
+private:
+	accel_view current_view{};
+
+	void gather_lights()
+	{
+		light_first.assign(materials.size() + 1, 0);
+		for (const auto& s: spheres)
+			if (materials[s.mat_index].kind == material::KIND_EMISSIVE)
+				++light_first[s.mat_index + 1];
+		for (size_t m = 0; m < materials.size(); ++m)
+			light_first[m + 1] += light_first[m];
+
+		lights.resize(light_first.back());
+		std::vector<uint32_t> cursor{light_first.begin(), light_first.end() - 1};
+		for (const auto& s: spheres)
+			if (materials[s.mat_index].kind == material::KIND_EMISSIVE)
+				lights[cursor[s.mat_index]++] = sphere_light{s.center, s.radius, materials[s.mat_index].emit, s.mat_index};
+
+		emitter_tree = light_tree_build(lights);
+	}
+
+	// every bottom level list is built with the accelerator of this list so the instances are
+	// traversed with it too, only the top level over the instances is always a binary bvh
+	void prepare_instances(enki::TaskScheduler* ts, BUILDER builder)
+	{
+		for (auto& blas: blases)
+		{
+			blas->accel = accel;
+			blas->prepare_soa(ts, builder);
+		}
+
+		std::vector<aabb> instance_bounds(instances.size());
+		for (size_t i = 0; i < instances.size(); ++i)
+			instance_bounds[i] = transform_bounds(instances[i].object_to_world, blases[instances[i].blas]->bounds());
+		instance_tree = bvh_build_binned_sah(instance_bounds, 1);
+	}
+
+	void build_spheres(enki::TaskScheduler* ts, BUILDER builder)
+	{
+		cache.reset();
+
+		classify_spheres(ts);
+		auto bounds = sphere_bounds(ts);
+		switch (builder)
+		{
+		case BUILDER_SAH: tree = bvh_build_binned_sah(bounds); break;
+		case BUILDER_LBVH: tree = bvh_build_lbvh(ts, bounds); break;
+		default: assert(false && "unreachable"); break;
+		}
+		build_sah_cost = bvh_sah_cost(ts, tree);
+		wide_tree = bvh_wide{};
+		quantized_tree = bvh_quantized{};
+
+		size_t simd_count = _round_up(spheres.size(), 4);
+		soa.center_x.resize(simd_count, real_t(10000));
+		soa.center_y.resize(simd_count, real_t(10000));
+		soa.center_z.resize(simd_count, real_t(10000));
+		soa.radius.resize(simd_count, real_t(0));
+		soa.mat_index.resize(simd_count, INT_MAX);
+		fill_soa(ts);
+		grid = uniform_grid{};
+		build_accel(ts);
+	}
+
+	// the grid is built over the bounded spheres as they're laid out in the soa arrays, so
+	// it works the same on top of a mapped cache
+	void build_grid(enki::TaskScheduler* ts)
+	{
+		const auto& v = view();
+		grid = uniform_grid_build(ts, v.center_x, v.center_y, v.center_z, v.radius, v.bounded_count);
+	}
+
+	// the wide bvh is quantized as it is when it's already 8 wide
+	void quantize(enki::TaskScheduler* ts)
+	{
+		if (wide_tree.width == BVHQ_WIDTH && wide_tree.node_count() > 0)
+		{
+			quantized_tree = bvh_quantize(ts, wide_tree);
+			return;
+		}
+		const auto& v = view();
+		quantized_tree = bvh_quantize(ts, bvh_wide_collapse(ts, v.nodes, v.node_count, BVHQ_WIDTH));
+	}
+
+	// a sphere is huge when it's flagged unbounded, like the ground spheres of the built in
+	// scenes, or when its box dwarfs the mean box of all the other spheres, the spheres are
+	// split in blocks of BVH_MIN_RANGE, each block is summed and counted in parallel then
+	// scattered to the offsets of its block so both lists stay in sphere order
+	void classify_spheres(enki::TaskScheduler* ts)
+	{
+		auto count = uint32_t(spheres.size());
+		auto block_count = (count + BVH_MIN_RANGE - 1) / BVH_MIN_RANGE;
+		auto for_each_block = [&](auto&& func) {
+			parallel_for(ts, block_count, 1, [&](uint32_t start, uint32_t end, uint32_t) {
+				for (auto block = start; block < end; ++block)
+					func(block, block * BVH_MIN_RANGE, std::min(count, (block + 1) * BVH_MIN_RANGE));
+			});
+		};
+
+		std::vector<double> block_area(block_count);
+		for_each_block([&](uint32_t block, uint32_t first, uint32_t last) {
+			double area = 0;
+			for (auto i = first; i < last; ++i)
+				area += spheres[i].bounds().surface_area();
+			block_area[block] = area;
+		});
+		double total_area = 0;
+		for (auto area: block_area)
+			total_area += area;
+
+		auto is_huge = [&](uint32_t i) {
+			if (spheres[i].unbounded)
+				return true;
+			double area = spheres[i].bounds().surface_area();
+			double others_mean = count > 1 ? (total_area - area) / double(count - 1) : area;
+			return area > others_mean * HUGE_SPHERE_AREA_RATIO;
+		};
+
+		std::vector<uint32_t> huge_first(block_count + 1);
+		for_each_block([&](uint32_t block, uint32_t first, uint32_t last) {
+			uint32_t huge_count = 0;
+			for (auto i = first; i < last; ++i)
+				if (is_huge(i))
+					++huge_count;
+			huge_first[block + 1] = huge_count;
+		});
+		for (uint32_t block = 0; block < block_count; ++block)
+			huge_first[block + 1] += huge_first[block];
+
+		huge_spheres.resize(huge_first[block_count]);
+		bounded_spheres.resize(count - huge_first[block_count]);
+		for_each_block([&](uint32_t block, uint32_t first, uint32_t last) {
+			auto huge = huge_first[block];
+			auto bounded = first - huge;
+			for (auto i = first; i < last; ++i)
+			{
+				if (is_huge(i))
+					huge_spheres[huge++] = int(i);
+				else
+					bounded_spheres[bounded++] = int(i);
+			}
+		});
+	}
+
+	std::vector<aabb> sphere_bounds(enki::TaskScheduler* ts) const
+	{
+		auto count = uint32_t(bounded_spheres.size());
+		std::vector<aabb> bounds(count);
+		parallel_for(ts, count, BVH_MIN_RANGE, [&](uint32_t start, uint32_t end, uint32_t) {
+			for (auto i = start; i < end; ++i)
+				bounds[i] = spheres[bounded_spheres[i]].bounds();
+		});
+		return bounds;
+	}
+
+	void fill_soa(enki::TaskScheduler* ts)
+	{
+		auto bounded_count = bounded_spheres.size();
+		auto set_soa = [&](size_t i, const sphere& sphere) {
+			soa.center_x[i] = sphere.center.x();
+			soa.center_y[i] = sphere.center.y();
+			soa.center_z[i] = sphere.center.z();
+			soa.radius[i] = sphere.radius;
+			soa.mat_index[i] = sphere.mat_index;
+		};
+
+		parallel_for(ts, uint32_t(bounded_count), BVH_MIN_RANGE, [&](uint32_t start, uint32_t end, uint32_t) {
+			for (auto i = start; i < end; ++i)
+				set_soa(i, spheres[bounded_spheres[tree.prim_indices[i]]]);
+		});
+		for (size_t i = 0; i < huge_spheres.size(); ++i)
+			set_soa(bounded_count + i, spheres[huge_spheres[i]]);
+	}
+
+	void set_hit_record(const ray& r, real_t t, int index, hit_record& rec) const
+	{
+		const auto& v = view();
+		rec.t = t;
+		rec.p = r.at(rec.t);
+		vec3 center {v.center_x[index], v.center_y[index], v.center_z[index]};
+		auto outward_normal = (rec.p - center) / v.radius[index];
+		rec.set_face_normal(r, outward_normal);
+		rec.mat_index = v.mat_index[index];
+	}
 };
\ No newline at end of file
@@ -3,12 +3,61 @@
 #include "rtweekend.h"
 #include "vec3.h"
 
+#include <algorithm>
 #include <vector>
 
+inline real_t luminance(const color& c)
+{
+	return real_t(0.2126) * c.x() + real_t(0.7152) * c.y() + real_t(0.0722) * c.z();
+}
+
+// first hit guides of a camera ray, the albedo of the material, the normal facing the ray and
+// the distance along it, and the luminance of the color it brought back with its square, added
+// up over the camera rays of a pixel
+struct aov_sample
+{
+	color albedo;
+	vec3 normal;
+	real_t depth;
+	real_t sample_luminance;
+	real_t sample_luminance_squared;
+
+	aov_sample& operator+=(const aov_sample& other)
+	{
+		albedo += other.albedo;
+		normal += other.normal;
+		depth += other.depth;
+		sample_luminance += other.sample_luminance;
+		sample_luminance_squared += other.sample_luminance_squared;
+		return *this;
+	}
+
+	void add_luminance(const color& c)
+	{
+		auto l = luminance(c);
+		sample_luminance += l;
+		sample_luminance_squared += l * l;
+	}
+};
+
 struct image
 {
 	int width, height;
 	std::vector<color> pixels;
+	// sum of the samples every pixel got over all the passes of a progressive render, every
+	// pixel has accumulated_samples of them
+	std::vector<color> accumulation;
+	int accumulated_samples = 0;
+	// first hit guides of every pixel averaged over its camera rays, empty unless enable_aovs
+	// was called, the denoiser uses them to find the edges
+	std::vector<color> albedo;
+	std::vector<vec3> normal;
+	std::vector<real_t> depth;
+	// first and second moments of the luminance of the samples of every pixel over its
+	// sample_count samples, the denoiser takes the noise of the pixel from them
+	std::vector<real_t> sample_luminance;
+	std::vector<real_t> sample_luminance_squared;
+	std::vector<int> sample_count;
 
 	image(int w, int h)
 	{
@@ -27,9 +76,61 @@ struct image
 		return pixels[y * width + x];
 	}
 
+	void clear_accumulation()
+	{
+		accumulation.assign(pixels.size(), color{});
+		accumulated_samples = 0;
+	}
+
+	void enable_aovs()
+	{
+		albedo.assign(pixels.size(), color{});
+		normal.assign(pixels.size(), vec3{});
+		depth.assign(pixels.size(), 0);
+		sample_luminance.assign(pixels.size(), 0);
+		sample_luminance_squared.assign(pixels.size(), 0);
+		sample_count.assign(pixels.size(), 0);
+	}
+
+	bool has_aovs() const
+	{
+		return albedo.empty() == false;
+	}
+
+	// sum is the aovs of count camera rays of pixel i, previous is how many camera rays are in
+	// the pixel's averages already, 0 replaces them
+	void store_aovs(size_t i, const aov_sample& sum, int count, int previous)
+	{
+		auto scale = real_t(1) / real_t(previous + count);
+		albedo[i] = (albedo[i] * real_t(previous) + sum.albedo) * scale;
+		normal[i] = (normal[i] * real_t(previous) + sum.normal) * scale;
+		depth[i] = (depth[i] * real_t(previous) + sum.depth) * scale;
+		sample_luminance[i] = (sample_luminance[i] * real_t(previous) + sum.sample_luminance) * scale;
+		sample_luminance_squared[i] = (sample_luminance_squared[i] * real_t(previous) + sum.sample_luminance_squared) * scale;
+		sample_count[i] = previous + count;
+	}
+
+	// variance of the mean luminance of pixel i, 0 until it has 2 samples
+	real_t luminance_variance(size_t i) const
+	{
+		if (sample_count[i] < 2)
+			return 0;
+		auto mean = sample_luminance[i];
+		auto n = real_t(sample_count[i]);
+		return std::max(real_t(0), sample_luminance_squared[i] - mean * mean) / (n - 1);
+	}
+
+	// gamma corrected average of the accumulated samples into pixels
+	void resolve()
+	{
+		auto scale = real_t(1) / real_t(accumulated_samples);
+		for (size_t i = 0; i < pixels.size(); ++i)
+			pixels[i] = sqrt(accumulation[i] * scale);
+	}
+
 	void write(std::ostream& out)
 	{
-		std::cout << "P3\n" << width << ' ' << height << "\n255\n";
+		out << "P3\n" << width << ' ' << height << "\n255\n";
 		for (int y = height - 1; y >= 0; --y)
 		{
 			auto y_offset = y * width;
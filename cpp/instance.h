@@ -0,0 +1,19 @@
+#pragma once
+
+#include "transform.h"
+
+// places a shared bottom level hittable_list in the world, blas indexes hittable_list::blases
+class instance
+{
+public:
+	instance() {}
+	instance(int b, const transform& t)
+		: object_to_world(t),
+		  world_to_object(t.inverse()),
+		  blas(b)
+	{}
+
+	transform object_to_world;
+	transform world_to_object;
+	int blas;
+};
@@ -0,0 +1,241 @@
+#pragma once
+
+#include "bvh.h"
+#include "morton.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <atomic>
+#include <vector>
+
+constexpr int LBVH_LEAF_SIZE = 4;
+constexpr uint32_t LBVH_RADIX_BITS = 8;
+constexpr uint32_t LBVH_RADIX_BUCKETS = 1 << LBVH_RADIX_BITS;
+
+inline static uint32_t
+_lbvh_block_count(enki::TaskScheduler* ts)
+{
+	return parallel_thread_count(ts) * 4;
+}
+
+// stable lsd radix sort of key/value pairs, every pass builds one histogram per block in
+// parallel, scans them in digit major order then scatters every block to its own offsets
+inline static void
+lbvh_radix_sort(enki::TaskScheduler* ts, std::vector<uint32_t>& keys, std::vector<int>& values, uint32_t key_bits)
+{
+	auto count = uint32_t(keys.size());
+	if (count == 0)
+		return;
+
+	auto block_count = _lbvh_block_count(ts);
+	auto block_size = (count + block_count - 1) / block_count;
+	block_count = (count + block_size - 1) / block_size;
+
+	std::vector<uint32_t> tmp_keys(count);
+	std::vector<int> tmp_values(count);
+	std::vector<uint32_t> offsets(block_count * LBVH_RADIX_BUCKETS);
+
+	for (uint32_t shift = 0; shift < key_bits; shift += LBVH_RADIX_BITS)
+	{
+		parallel_for(ts, block_count, 1, [&](uint32_t start, uint32_t end, uint32_t) {
+			for (auto block = start; block < end; ++block)
+			{
+				auto histogram = &offsets[block * LBVH_RADIX_BUCKETS];
+				std::fill(histogram, histogram + LBVH_RADIX_BUCKETS, 0);
+				auto first = block * block_size;
+				auto last = std::min(count, first + block_size);
+				for (auto i = first; i < last; ++i)
+					++histogram[(keys[i] >> shift) & (LBVH_RADIX_BUCKETS - 1)];
+			}
+		});
+
+		uint32_t sum = 0;
+		for (uint32_t digit = 0; digit < LBVH_RADIX_BUCKETS; ++digit)
+		{
+			for (uint32_t block = 0; block < block_count; ++block)
+			{
+				auto& offset = offsets[block * LBVH_RADIX_BUCKETS + digit];
+				auto digit_count = offset;
+				offset = sum;
+				sum += digit_count;
+			}
+		}
+
+		parallel_for(ts, block_count, 1, [&](uint32_t start, uint32_t end, uint32_t) {
+			for (auto block = start; block < end; ++block)
+			{
+				auto offset = &offsets[block * LBVH_RADIX_BUCKETS];
+				auto first = block * block_size;
+				auto last = std::min(count, first + block_size);
+				for (auto i = first; i < last; ++i)
+				{
+					auto pos = offset[(keys[i] >> shift) & (LBVH_RADIX_BUCKETS - 1)]++;
+					tmp_keys[pos] = keys[i];
+					tmp_values[pos] = values[i];
+				}
+			}
+		});
+
+		keys.swap(tmp_keys);
+		values.swap(tmp_values);
+	}
+}
+
+// linear bvh (Karras 2012), the primitives are sorted along a morton curve and cut into
+// leaves of leaf_size consecutive primitives, every inner node then finds its own range
+// and split independently so the whole hierarchy is emitted in parallel
+// the children of inner node i are always written to slots 1 + 2i and 2 + 2i which keeps
+// them adjacent as the bvh layout requires, the bounds are then propagated bottom up,
+// the second child to reach a parent computes its bounds
+inline static bvh
+bvh_build_lbvh(enki::TaskScheduler* ts, const std::vector<aabb>& prim_bounds, int leaf_size = LBVH_LEAF_SIZE)
+{
+	bvh self{};
+
+	auto prim_count = uint32_t(prim_bounds.size());
+	if (prim_count == 0)
+		return self;
+
+	std::vector<aabb> partial_bounds(parallel_thread_count(ts));
+	parallel_for(ts, prim_count, BVH_MIN_RANGE, [&](uint32_t start, uint32_t end, uint32_t thread_ix) {
+		aabb b{};
+		for (auto i = start; i < end; ++i)
+			b.expand(prim_bounds[i].center());
+		partial_bounds[thread_ix].expand(b);
+	});
+	aabb centroid_bounds{};
+	for (const auto& b: partial_bounds)
+		centroid_bounds.expand(b);
+
+	std::vector<uint32_t> codes(prim_count);
+	self.prim_indices.resize(prim_count);
+	parallel_for(ts, prim_count, BVH_MIN_RANGE, [&](uint32_t start, uint32_t end, uint32_t) {
+		for (auto i = start; i < end; ++i)
+		{
+			codes[i] = morton_encode(centroid_bounds, prim_bounds[i].center());
+			self.prim_indices[i] = int(i);
+		}
+	});
+
+	lbvh_radix_sort(ts, codes, self.prim_indices, 30);
+
+	auto leaf_count = int((prim_count + leaf_size - 1) / leaf_size);
+	self.nodes.resize(2 * leaf_count - 1);
+
+	auto leaf_node = [&](int leaf) {
+		bvh_node node{};
+		node.left_first = leaf * leaf_size;
+		node.count = std::min(leaf_size, int(prim_count) - leaf * leaf_size);
+		return node;
+	};
+
+	auto leaf_bounds = [&](const bvh_node& node) {
+		aabb b{};
+		for (int i = node.left_first; i < node.left_first + node.count; ++i)
+			b.expand(prim_bounds[self.prim_indices[i]]);
+		return b;
+	};
+
+	if (leaf_count == 1)
+	{
+		self.nodes[0] = leaf_node(0);
+		self.nodes[0].set_bounds(leaf_bounds(self.nodes[0]));
+		return self;
+	}
+
+	// length of the common prefix of leaves i and j, equal codes are told apart by their index,
+	// it grows strictly from a node to its inner children and stays in 2..63 for 30 bit
+	// codes so the inner nodes are at most 61 deep, well within BVH_STACK_SIZE
+	auto delta = [&](int i, int j) {
+		if (j < 0 || j >= leaf_count)
+			return -1;
+		auto a = codes[i * leaf_size];
+		auto b = codes[j * leaf_size];
+		if (a == b)
+			return 32 + _clz32(uint32_t(i ^ j));
+		return _clz32(a ^ b);
+	};
+
+	// parent holds the inner node index of the parent of each slot
+	std::vector<int> parent(self.nodes.size());
+	std::vector<int> inner_slot(leaf_count - 1);
+	std::vector<int> leaf_slot(leaf_count);
+	parent[0] = -1;
+	inner_slot[0] = 0;
+	self.nodes[0].left_first = 1;
+
+	parallel_for(ts, uint32_t(leaf_count - 1), BVH_MIN_RANGE, [&](uint32_t start, uint32_t end, uint32_t) {
+		for (int i = int(start); i < int(end); ++i)
+		{
+			// direction and upper bound of the range covered by this node
+			int d = delta(i, i + 1) - delta(i, i - 1) >= 0 ? 1 : -1;
+			int delta_min = delta(i, i - d);
+			int l_max = 2;
+			while (delta(i, i + l_max * d) > delta_min)
+				l_max *= 2;
+
+			// binary search for the other end of the range
+			int l = 0;
+			for (int t = l_max / 2; t >= 1; t /= 2)
+				if (delta(i, i + (l + t) * d) > delta_min)
+					l += t;
+			int j = i + l * d;
+
+			// binary search for the split position
+			int delta_node = delta(i, j);
+			int s = 0;
+			int t = l;
+			do
+			{
+				t = (t + 1) >> 1;
+				if (delta(i, i + (s + t) * d) > delta_node)
+					s += t;
+			} while (t > 1);
+			int gamma = i + s * d + (d < 0 ? -1 : 0);
+
+			int children[2] = {gamma, gamma + 1};
+			bool is_leaf[2] = {std::min(i, j) == gamma, std::max(i, j) == gamma + 1};
+			for (int c = 0; c < 2; ++c)
+			{
+				auto slot = 1 + 2 * i + c;
+				parent[slot] = i;
+				if (is_leaf[c])
+				{
+					self.nodes[slot] = leaf_node(children[c]);
+					leaf_slot[children[c]] = slot;
+				}
+				else
+				{
+					self.nodes[slot].left_first = 1 + 2 * children[c];
+					self.nodes[slot].count = 0;
+					inner_slot[children[c]] = slot;
+				}
+			}
+		}
+	});
+
+	std::vector<std::atomic<uint32_t>> visits(leaf_count - 1);
+	parallel_for(ts, uint32_t(leaf_count), BVH_MIN_RANGE, [&](uint32_t start, uint32_t end, uint32_t) {
+		for (int leaf = int(start); leaf < int(end); ++leaf)
+		{
+			auto slot = leaf_slot[leaf];
+			self.nodes[slot].set_bounds(leaf_bounds(self.nodes[slot]));
+
+			auto p = parent[slot];
+			while (p != -1)
+			{
+				// the first child to arrive leaves, the sibling's bounds may not be ready yet
+				if (visits[p].fetch_add(1, std::memory_order_acq_rel) == 0)
+					break;
+
+				auto b = self.nodes[1 + 2 * p].bounds();
+				b.expand(self.nodes[2 + 2 * p].bounds());
+				auto p_slot = inner_slot[p];
+				self.nodes[p_slot].set_bounds(b);
+				p = parent[p_slot];
+			}
+		}
+	});
+
+	return self;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "rtweekend.h"
+
+// an emissive sphere of the scene, lights are sampled over the cone of directions they cover
+// from the point being shaded so every sample lands on the light
+struct sphere_light
+{
+	point3 center;
+	real_t radius;
+	color emit;
+	int mat_index;
+};
+
+// 1 - cos of the half angle of the cone light covers from p, written as sin^2 / (1 + cos) so
+// that small far lights don't round it to 0, 0 when p is inside the light
+inline static real_t
+_sphere_light_cone(const sphere_light& light, const point3& p)
+{
+	auto dist2 = (light.center - p).length_squared();
+	auto r2 = light.radius * light.radius;
+	if (dist2 <= r2)
+		return 0;
+	auto sin2_max = r2 / dist2;
+	return sin2_max / (1 + sqrt(1 - sin2_max));
+}
+
+// pdf per solid angle of sample_sphere_light choosing a given direction towards light from p
+inline static real_t
+sphere_light_pdf(const sphere_light& light, const point3& p)
+{
+	auto cone = _sphere_light_cone(light, p);
+	return cone > 0 ? 1 / (2 * pi * cone) : 0;
+}
+
+// direction from p uniform over the cone light covers and the distance along it to the light's
+// surface, false when p is inside the light
+inline static bool
+sample_sphere_light(const sphere_light& light, const point3& p, real_t u1, real_t u2, vec3& dir, real_t& dist, real_t& pdf)
+{
+	auto cone = _sphere_light_cone(light, p);
+	if (cone <= 0)
+		return false;
+
+	auto d = light.center - p;
+	auto dist2 = d.length_squared();
+	auto w = d / sqrt(dist2);
+	auto a = fabs(w.x()) > real_t(0.9) ? vec3{0, 1, 0} : vec3{1, 0, 0};
+	auto v = unit_vector(cross(w, a));
+	auto u = cross(w, v);
+
+	// 1 - cos_theta is uniform in [0, cone)
+	auto one_minus_cos = u1 * cone;
+	auto cos_theta = 1 - one_minus_cos;
+	auto sin_theta = sqrt(max(real_t(0), one_minus_cos * (2 - one_minus_cos)));
+	auto phi = 2 * pi * u2;
+	dir = u * (cos(phi) * sin_theta) + v * (sin(phi) * sin_theta) + w * cos_theta;
+
+	// near root of the ray against the light
+	auto b = dot(d, dir);
+	auto h = b * b - (dist2 - light.radius * light.radius);
+	dist = b - sqrt(max(real_t(0), h));
+	pdf = 1 / (2 * pi * cone);
+	return true;
+}
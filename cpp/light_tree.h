@@ -0,0 +1,385 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "aabb.h"
+#include "light.h"
+
+#include <vector>
+
+constexpr int LIGHT_TREE_BIN_COUNT = 12;
+
+// bounds, orientation and power of a group of lights (Conty and Kulla, "Importance Sampling of
+// Many Lights with Adaptive Tree Splitting"), the normals of the emitting surfaces are within
+// theta_o of axis and the light leaves them within theta_e, a sphere emits every way so its
+// theta_o is pi and its theta_e pi / 2
+struct light_tree_node
+{
+	aabb bounds;
+	vec3 axis;
+	real_t theta_o;
+	real_t theta_e;
+	real_t power;
+	// internal node: index of the left child, the right one follows it, leaf: -1
+	int left;
+	// leaf: index of the light in the list the tree was built over, internal node: -1
+	int light;
+};
+
+struct light_tree
+{
+	std::vector<light_tree_node> nodes;
+	std::vector<int> parents;
+	// leaf node of every light
+	std::vector<int> light_leaf;
+};
+
+inline static real_t
+_light_tree_angle(const vec3& a, const vec3& b)
+{
+	return acos(clamp(dot(a, b), -1, 1));
+}
+
+// the lights are picked by power, a sphere gives out its radiance times pi over its whole area
+inline static real_t
+_light_tree_power(const sphere_light& light)
+{
+	auto luminance = real_t(0.2126) * light.emit.x() + real_t(0.7152) * light.emit.y() + real_t(0.0722) * light.emit.z();
+	return luminance * 4 * pi * light.radius * light.radius * pi;
+}
+
+inline static light_tree_node
+_light_tree_leaf(const sphere_light& light, int index)
+{
+	light_tree_node self{};
+	self.bounds.expand(light.center - vec3{light.radius});
+	self.bounds.expand(light.center + vec3{light.radius});
+	self.axis = vec3{0, 1, 0};
+	self.theta_o = pi;
+	self.theta_e = pi / 2;
+	self.power = _light_tree_power(light);
+	self.left = -1;
+	self.light = index;
+	return self;
+}
+
+// smallest cone holding the normal cones of a and b, the emission spread is the larger one
+inline static light_tree_node
+_light_tree_union(const light_tree_node& a, const light_tree_node& b)
+{
+	if (a.power <= 0)
+		return b;
+	if (b.power <= 0)
+		return a;
+
+	light_tree_node self{};
+	self.bounds = a.bounds;
+	self.bounds.expand(b.bounds);
+	self.power = a.power + b.power;
+	self.theta_e = max(a.theta_e, b.theta_e);
+	self.left = -1;
+	self.light = -1;
+
+	const auto& wide = a.theta_o >= b.theta_o ? a : b;
+	const auto& narrow = a.theta_o >= b.theta_o ? b : a;
+	auto theta_d = _light_tree_angle(wide.axis, narrow.axis);
+	if (fmin(theta_d + narrow.theta_o, pi) <= wide.theta_o)
+	{
+		self.axis = wide.axis;
+		self.theta_o = wide.theta_o;
+		return self;
+	}
+
+	auto theta_o = (wide.theta_o + theta_d + narrow.theta_o) / 2;
+	if (theta_o >= pi)
+	{
+		self.axis = wide.axis;
+		self.theta_o = pi;
+		return self;
+	}
+
+	// rotate the wide axis towards the narrow one until the cone covers both
+	auto theta_r = theta_o - wide.theta_o;
+	auto ortho = cross(wide.axis, narrow.axis);
+	if (ortho.length_squared() <= 0)
+	{
+		self.axis = wide.axis;
+		self.theta_o = pi;
+		return self;
+	}
+	ortho = unit_vector(ortho);
+	auto side = cross(ortho, wide.axis);
+	self.axis = unit_vector(wide.axis * cos(theta_r) + side * sin(theta_r));
+	self.theta_o = theta_o;
+	return self;
+}
+
+// solid angle measure of a cone of normals spreading theta_e, the orientation part of the split cost
+inline static real_t
+_light_tree_orientation_measure(real_t theta_o, real_t theta_e)
+{
+	auto theta_w = fmin(theta_o + theta_e, pi);
+	return 2 * pi * (1 - cos(theta_o)) +
+		pi / 2 * (2 * theta_w * sin(theta_o) - cos(theta_o - 2 * theta_w) - 2 * theta_o * sin(theta_o) + cos(theta_o));
+}
+
+// top down builder with one light per leaf, every node is split at the best of
+// LIGHT_TREE_BIN_COUNT planes per axis by the surface area orientation heuristic, power times
+// bounds area times orientation measure on each side, with a penalty for cutting across the
+// short axes of a flat node
+inline static light_tree
+light_tree_build(const std::vector<sphere_light>& lights)
+{
+	light_tree self{};
+	auto light_count = int(lights.size());
+	if (light_count == 0)
+		return self;
+
+	std::vector<light_tree_node> leaves(light_count);
+	std::vector<point3> centroids(light_count);
+	std::vector<int> indices(light_count);
+	for (int i = 0; i < light_count; ++i)
+	{
+		leaves[i] = _light_tree_leaf(lights[i], i);
+		centroids[i] = lights[i].center;
+		indices[i] = i;
+	}
+
+	struct range
+	{
+		int node;
+		int first;
+		int count;
+	};
+
+	self.nodes.reserve(2 * light_count);
+	self.parents.reserve(2 * light_count);
+	self.nodes.push_back(light_tree_node{});
+	self.parents.push_back(-1);
+	self.light_leaf.assign(light_count, -1);
+
+	std::vector<range> stack;
+	stack.push_back(range{0, 0, light_count});
+	while (stack.empty() == false)
+	{
+		auto r = stack.back();
+		stack.pop_back();
+
+		if (r.count == 1)
+		{
+			self.nodes[r.node] = leaves[indices[r.first]];
+			self.light_leaf[indices[r.first]] = r.node;
+			continue;
+		}
+
+		light_tree_node node{};
+		aabb centroid_bounds{};
+		for (int i = r.first; i < r.first + r.count; ++i)
+		{
+			node = _light_tree_union(node, leaves[indices[i]]);
+			centroid_bounds.expand(centroids[indices[i]]);
+		}
+
+		int best_axis = -1;
+		int best_split = 0;
+		real_t best_cost = infinity;
+		auto extent = node.bounds.extent();
+		auto max_extent = max(extent.x(), max(extent.y(), extent.z()));
+		auto centroid_extent = centroid_bounds.extent();
+		for (int axis = 0; axis < 3; ++axis)
+		{
+			auto axis_min = centroid_bounds.min[axis];
+			auto axis_extent = centroid_extent[axis];
+			if (axis_extent <= 0)
+				continue;
+
+			light_tree_node bins[LIGHT_TREE_BIN_COUNT]{};
+			auto scale = LIGHT_TREE_BIN_COUNT / axis_extent;
+			for (int i = r.first; i < r.first + r.count; ++i)
+			{
+				auto b = int((centroids[indices[i]][axis] - axis_min) * scale);
+				if (b > LIGHT_TREE_BIN_COUNT - 1) b = LIGHT_TREE_BIN_COUNT - 1;
+				bins[b] = _light_tree_union(bins[b], leaves[indices[i]]);
+			}
+
+			auto cost_of = [](const light_tree_node& n) {
+				if (n.power <= 0)
+					return real_t(0);
+				return n.power * n.bounds.surface_area() * _light_tree_orientation_measure(n.theta_o, n.theta_e);
+			};
+
+			real_t right_cost[LIGHT_TREE_BIN_COUNT - 1];
+			light_tree_node right{};
+			for (int b = LIGHT_TREE_BIN_COUNT - 1; b > 0; --b)
+			{
+				right = _light_tree_union(right, bins[b]);
+				right_cost[b - 1] = cost_of(right);
+			}
+
+			auto regularization = max_extent / axis_extent;
+			light_tree_node left{};
+			for (int b = 0; b < LIGHT_TREE_BIN_COUNT - 1; ++b)
+			{
+				left = _light_tree_union(left, bins[b]);
+				if (left.power <= 0 || right_cost[b] <= 0)
+					continue;
+				auto cost = regularization * (cost_of(left) + right_cost[b]);
+				if (cost < best_cost)
+				{
+					best_cost = cost;
+					best_axis = axis;
+					best_split = b;
+				}
+			}
+		}
+
+		int mid = r.first + r.count / 2;
+		if (best_axis != -1)
+		{
+			auto axis_min = centroid_bounds.min[best_axis];
+			auto scale = LIGHT_TREE_BIN_COUNT / centroid_extent[best_axis];
+			int j = r.first + r.count - 1;
+			mid = r.first;
+			while (mid <= j)
+			{
+				auto b = int((centroids[indices[mid]][best_axis] - axis_min) * scale);
+				if (b > LIGHT_TREE_BIN_COUNT - 1) b = LIGHT_TREE_BIN_COUNT - 1;
+				if (b <= best_split)
+				{
+					++mid;
+				}
+				else
+				{
+					auto tmp = indices[mid];
+					indices[mid] = indices[j];
+					indices[j] = tmp;
+					--j;
+				}
+			}
+		}
+		// lights with no power or all in the same spot can't be told apart, split in the middle
+		if (mid == r.first || mid == r.first + r.count)
+			mid = r.first + r.count / 2;
+
+		auto left_index = int(self.nodes.size());
+		node.left = left_index;
+		self.nodes[r.node] = node;
+		self.nodes.push_back(light_tree_node{});
+		self.nodes.push_back(light_tree_node{});
+		self.parents.push_back(r.node);
+		self.parents.push_back(r.node);
+		stack.push_back(range{left_index + 1, mid, r.first + r.count - mid});
+		stack.push_back(range{left_index, r.first, mid - r.first});
+	}
+
+	return self;
+}
+
+// cos(max(0, a - b)) from the sines and cosines of a and b, a - b is at least 0 when
+// cos_a <= cos_b
+inline static real_t
+_light_tree_cos_sub_clamped(real_t sin_a, real_t cos_a, real_t sin_b, real_t cos_b)
+{
+	if (cos_a > cos_b)
+		return 1;
+	return cos_a * cos_b + sin_a * sin_b;
+}
+
+// how much the lights under node are expected to give to a point p with normal n, their power
+// over the squared distance scaled by the best case cosines the bounds allow, at the emitter
+// and at p, 0 when none of the lights can reach p's side of the surface, the angles are
+// handled through their cosines since this runs twice per level of every pick
+inline static real_t
+light_tree_importance(const light_tree_node& node, const point3& p, const vec3& n)
+{
+	auto center = node.bounds.center();
+	auto d = center - p;
+	auto dist2 = d.length_squared();
+	auto half_diagonal2 = node.bounds.extent().length_squared() / 4;
+	// inside the bounds every direction is possible and the distance means nothing
+	if (dist2 <= half_diagonal2)
+		return node.power / max(half_diagonal2, real_t(1e-8));
+
+	auto dir = d / sqrt(dist2);
+	// theta_u, the half angle the bounds cover from p
+	auto sin2_u = half_diagonal2 / dist2;
+	auto sin_u = sqrt(sin2_u);
+	auto cos_u = sqrt(1 - sin2_u);
+
+	auto cos_i = dot(n, dir);
+	auto sin_i = sqrt(max(real_t(0), 1 - cos_i * cos_i));
+	auto cos_receiver = _light_tree_cos_sub_clamped(sin_i, cos_i, sin_u, cos_u);
+	if (cos_receiver <= 0)
+		return 0;
+
+	// the emitter side only matters for cones narrower than the whole sphere
+	real_t cos_emit = 1;
+	if (node.theta_o < pi)
+	{
+		auto theta_emit = max(real_t(0), _light_tree_angle(node.axis, -dir) - node.theta_o - asin(sin_u));
+		if (theta_emit >= node.theta_e)
+			return 0;
+		cos_emit = cos(theta_emit);
+	}
+
+	return node.power * cos_emit * cos_receiver / dist2;
+}
+
+// walks down from the root picking each child with probability proportional to its importance
+// from (p, n), u is reused at every level rescaled to the part of [0, 1) the picked child
+// owns, returns the light and the probability of the walk, -1 if no light can reach p
+inline static int
+light_tree_pick(const light_tree& self, const point3& p, const vec3& n, real_t u, real_t& pick_pdf)
+{
+	pick_pdf = 0;
+	if (self.nodes.empty())
+		return -1;
+
+	real_t pdf = 1;
+	int node = 0;
+	while (self.nodes[node].left != -1)
+	{
+		auto left = self.nodes[node].left;
+		auto left_importance = light_tree_importance(self.nodes[left], p, n);
+		auto right_importance = light_tree_importance(self.nodes[left + 1], p, n);
+		auto total = left_importance + right_importance;
+		if (total <= 0)
+			return -1;
+
+		auto p_left = left_importance / total;
+		if (u < p_left)
+		{
+			u = fmin(u / p_left, real_t(0.99999994));
+			pdf *= p_left;
+			node = left;
+		}
+		else
+		{
+			u = fmin((u - p_left) / (1 - p_left), real_t(0.99999994));
+			pdf *= 1 - p_left;
+			node = left + 1;
+		}
+	}
+	pick_pdf = pdf;
+	return self.nodes[node].light;
+}
+
+// probability of light_tree_pick picking light from (p, n), the walk is replayed from the
+// light's leaf up to the root
+inline static real_t
+light_tree_pick_pdf(const light_tree& self, const point3& p, const vec3& n, int light)
+{
+	real_t pdf = 1;
+	auto node = self.light_leaf[light];
+	while (self.parents[node] != -1)
+	{
+		auto left = self.nodes[self.parents[node]].left;
+		auto left_importance = light_tree_importance(self.nodes[left], p, n);
+		auto right_importance = light_tree_importance(self.nodes[left + 1], p, n);
+		auto total = left_importance + right_importance;
+		if (total <= 0)
+			return 0;
+		pdf *= (node == left ? left_importance : right_importance) / total;
+		node = self.parents[node];
+	}
+	return pdf;
+}
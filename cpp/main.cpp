@@ -6,11 +6,21 @@
 #include "camera.h"
 #include "material.h"
 #include "image.h"
+#include "wavefront.h"
+#include "random_simd.h"
+#include "random_bench.h"
+#include "sampler.h"
+#include "denoise.h"
 
 #include <TaskScheduler.h>
 
 #include <iostream>
+#include <fstream>
 #include <chrono>
+#include <string>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
 
 real_t hit_sphere(const point3& center, real_t radius, const ray& r)
 {
@@ -49,38 +59,259 @@ struct raytrace_stat
 {
 	size_t ray_count;
 	size_t bounces;
+	// paths ended by russian roulette
+	size_t roulette_terminations;
+	// visibility rays towards the lights
+	size_t shadow_rays;
 };
 
-color ray_color(random_series* series, const ray& r, const hittable_list& world, int depth, raytrace_stat& stat)
+color ray_color(sampler* smp, const ray& r, const hittable_list& world, int depth, raytrace_stat& stat);
+
+color sky_color(const hittable_list& world, const ray& r)
+{
+	auto unit_direction = unit_vector(r.direction());
+	auto t = 0.5 * (unit_direction.y() + 1.0);
+	return world.sky_intensity * ((1.0 - t) * color{1.0, 1.0, 1.0} + t * color{0.5, 0.7, 1.0});
+}
+
+// color of a ray whose closest hit is already known, the bounces are traced with ray_color
+color shade(sampler* smp, const ray& r, bool hit, const hit_record& rec, const hittable_list& world, int depth, raytrace_stat& stat)
+{
+	if (hit) {
+		ray scattered;
+		color attenuation;
+		auto& mat = world.materials[rec.mat_index];
+		if (mat.scatter(smp, r, rec, attenuation, scattered))
+		{
+			++stat.bounces;
+			return attenuation * ray_color(smp, scattered, world, depth - 1, stat);
+		}
+		return mat.emitted();
+	}
+	return sky_color(world, r);
+}
+
+color ray_color(sampler* smp, const ray& r, const hittable_list& world, int depth, raytrace_stat& stat)
 {
 	hit_record rec;
 
 	if (depth <= 0)
 		return color{};
 
-	if (world.hit_soa(r, 0.001, infinity, rec)) {
+	bool hit = world.closest_hit(r, 0.001, infinity, rec);
+	return shade(smp, r, hit, rec, world, depth, stat);
+}
+
+// bounces every path goes through before russian roulette can end it
+constexpr int ROULETTE_MIN_DEPTH = 3;
+
+// past ROULETTE_MIN_DEPTH bounces a path whose throughput dropped is ended with probability q
+// and the survivors are divided by 1 - q so the estimate stays unbiased, returns false if the
+// path ended
+bool russian_roulette(sampler* smp, int bounce, color& throughput, raytrace_stat& stat)
+{
+	if (bounce + 1 < ROULETTE_MIN_DEPTH)
+		return true;
+
+	auto max_throughput = max(throughput.x(), max(throughput.y(), throughput.z()));
+	if (max_throughput >= 1)
+		return true;
+
+	auto q = max(real_t(0.05), 1 - max_throughput);
+	if (random_double(smp) < q)
+	{
+		++stat.roulette_terminations;
+		return false;
+	}
+	throughput = throughput / (1 - q);
+	return true;
+}
+
+// loop version of shade, the path is followed forward carrying its throughput instead of
+// multiplying the attenuations on the way back up the recursion
+color shade_iterative(sampler* smp, ray r, bool hit, hit_record rec, const hittable_list& world, int depth, raytrace_stat& stat)
+{
+	color throughput{1, 1, 1};
+	for (int bounce = 0; bounce < depth; ++bounce)
+	{
+		if (bounce > 0)
+			hit = world.closest_hit(r, 0.001, infinity, rec);
+		if (hit == false)
+			return throughput * sky_color(world, r);
+
 		ray scattered;
 		color attenuation;
-		auto& mat = world.materials[rec.mat_index];
-		if (mat.scatter(series, r, rec, attenuation, scattered))
+		const auto& mat = world.materials[rec.mat_index];
+		if (mat.scatter(smp, r, rec, attenuation, scattered) == false)
+			return throughput * mat.emitted();
+		throughput = throughput * attenuation;
+		r = scattered;
+
+		if (russian_roulette(smp, bounce, throughput, stat) == false)
+			return color{};
+		++stat.bounces;
+	}
+	return color{};
+}
+
+color ray_color_iterative(sampler* smp, const ray& r, const hittable_list& world, int depth, raytrace_stat& stat)
+{
+	hit_record rec;
+	bool hit = world.closest_hit(r, 0.001, infinity, rec);
+	return shade_iterative(smp, r, hit, rec, world, depth, stat);
+}
+
+// weight of a sample drawn with pdf a that could also have been drawn with pdf b
+inline real_t power_heuristic(real_t a, real_t b)
+{
+	return a * a / (a * a + b * b);
+}
+
+// picks one of the scene lights to sample from the point p with normal n, -1 if there's none
+// worth sampling
+int pick_light(const hittable_list& world, const point3& p, const vec3& n, real_t u, real_t& pick_pdf)
+{
+	if (world.light_pick == hittable_list::LIGHT_PICK_TREE)
+		return light_tree_pick(world.emitter_tree, p, n, u, pick_pdf);
+
+	auto count = int(world.lights.size());
+	pick_pdf = real_t(1) / real_t(count);
+	return std::min(int(u * real_t(count)), count - 1);
+}
+
+// probability of pick_light picking light from (p, n)
+real_t pick_light_pdf(const hittable_list& world, const point3& p, const vec3& n, int light)
+{
+	if (world.light_pick == hittable_list::LIGHT_PICK_TREE)
+		return light_tree_pick_pdf(world.emitter_tree, p, n, light);
+	return real_t(1) / real_t(world.lights.size());
+}
+
+// light reaching the lambertian hit rec straight from a light sample, weighted against the
+// bounce that could have found the same light
+color sample_lights(sampler* smp, const hittable_list& world, const hit_record& rec, const material& mat, raytrace_stat& stat)
+{
+	if (world.lights.empty())
+		return color{};
+
+	real_t pick_pdf;
+	auto picked = pick_light(world, rec.p, rec.normal, smp->get_1d(), pick_pdf);
+	real_t u1, u2;
+	smp->get_2d(u1, u2);
+	if (picked == -1)
+		return color{};
+
+	const auto& light = world.lights[picked];
+	vec3 dir;
+	real_t dist, cone_pdf;
+	if (sample_sphere_light(light, rec.p, u1, u2, dir, dist, cone_pdf) == false)
+		return color{};
+
+	auto cos_theta = dot(rec.normal, dir);
+	if (cos_theta <= 0)
+		return color{};
+
+	++stat.shadow_rays;
+	if (world.occluded(ray{rec.p, dir}, 0.001, dist * real_t(0.999)))
+		return color{};
+
+	auto light_pdf = pick_pdf * cone_pdf;
+	auto bsdf_pdf = cos_theta / pi;
+	return (mat.albedo / pi) * light.emit * (cos_theta * power_heuristic(light_pdf, bsdf_pdf) / light_pdf);
+}
+
+// shade_iterative that also samples a light at every lambertian hit (next event estimation),
+// a bounce that hits a light anyway is weighted against the light sample that could have
+// found it with the power heuristic (multiple importance sampling), after a metal or a
+// dielectric bounce, where the lights aren't sampled, it counts in full
+color shade_nee(sampler* smp, ray r, bool hit, hit_record rec, const hittable_list& world, int depth, raytrace_stat& stat)
+{
+	color radiance{0, 0, 0};
+	color throughput{1, 1, 1};
+	// pdf of the lambertian bounce r came from, 0 for the camera ray and the other bounces,
+	// and the normal it left from
+	real_t bsdf_pdf = 0;
+	vec3 bsdf_normal{};
+	for (int bounce = 0; bounce < depth; ++bounce)
+	{
+		if (bounce > 0)
+			hit = world.closest_hit(r, 0.001, infinity, rec);
+		if (hit == false)
+			return radiance + throughput * sky_color(world, r);
+
+		const auto& mat = world.materials[rec.mat_index];
+		if (mat.kind == material::KIND_EMISSIVE)
 		{
-			++stat.bounces;
-			return attenuation * ray_color(series, scattered, world, depth - 1, stat);
+			real_t weight = 1;
+			auto light = world.light_at(rec);
+			if (bsdf_pdf > 0 && light != -1)
+			{
+				auto light_pdf = pick_light_pdf(world, r.origin(), bsdf_normal, light) * sphere_light_pdf(world.lights[light], r.origin());
+				weight = power_heuristic(bsdf_pdf, light_pdf);
+			}
+			return radiance + throughput * mat.emit * weight;
 		}
-		return color{};
+
+		auto lambertian = mat.kind == material::KIND_LAMBERTIAN;
+		if (lambertian)
+			radiance += throughput * sample_lights(smp, world, rec, mat, stat);
+
+		ray scattered;
+		color attenuation;
+		if (mat.scatter(smp, r, rec, attenuation, scattered) == false)
+			return radiance;
+		bsdf_pdf = lambertian ? max(real_t(0), dot(rec.normal, unit_vector(scattered.direction()))) / pi : 0;
+		bsdf_normal = rec.normal;
+		throughput = throughput * attenuation;
+		r = scattered;
+
+		if (russian_roulette(smp, bounce, throughput, stat) == false)
+			return radiance;
+		++stat.bounces;
 	}
-	auto unit_direction = unit_vector(r.direction());
-	auto t = 0.5 * (unit_direction.y() + 1.0);
-	return (1.0 - t) * color{1.0, 1.0, 1.0} + t * color{0.5, 0.7, 1.0};
+	return radiance;
 }
 
-hittable_list random_scene(random_series* series)
+color ray_color_nee(sampler* smp, const ray& r, const hittable_list& world, int depth, raytrace_stat& stat)
 {
-	hittable_list world;
+	hit_record rec;
+	bool hit = world.closest_hit(r, 0.001, infinity, rec);
+	return shade_nee(smp, r, hit, rec, world, depth, stat);
+}
+
+enum INTEGRATOR
+{
+	// one path at a time per pixel, ray_color recursion
+	INTEGRATOR_RECURSIVE,
+	// one path at a time per pixel, a loop carrying the throughput with russian roulette
+	INTEGRATOR_ITERATIVE,
+	// all the paths of a sample pass go through each stage together, see wavefront.h
+	INTEGRATOR_WAVEFRONT,
+	// the iterative loop sampling the lights at every lambertian hit, see shade_nee
+	INTEGRATOR_NEE,
+};
+
+enum GROUND
+{
+	// the huge sphere of the book, flagged unbounded so it's tested on every ray
+	GROUND_SPHERE,
+	// the infinite plane y = 0 the sphere stands in for
+	GROUND_PLANE,
+};
 
+// the ground of the scenes built around the random_scene cluster
+void add_ground(hittable_list& world, GROUND ground)
+{
 	auto ground_material = world.add(lambertian(color(0.5, 0.5, 0.5)));
-	world.add(sphere{point3(0, -1000, 0), 1000, ground_material});
+	if (ground == GROUND_PLANE)
+		world.add(plane{point3(0, 0, 0), vec3(0, 1, 0), ground_material});
+	else
+		world.add(sphere{point3(0, -1000, 0), 1000, ground_material, true});
+}
 
+// the field of small spheres and the 3 big ones from random_scene, without the ground
+void add_random_cluster(hittable_list& world, random_series* series)
+{
 	for (int a = -11; a < 11; ++a)
 	{
 		for (int b = -11; b < 11; ++b)
@@ -122,8 +353,64 @@ hittable_list random_scene(random_series* series)
 
 	auto material3 = world.add(metal(color(0.7, 0.6, 0.5), 0.0));
 	world.add(sphere{point3(4, 1, 0), 1.0, material3});
+}
+
+hittable_list random_scene(random_series* series, GROUND ground)
+{
+	hittable_list world;
+
+	add_ground(world, ground);
+
+	add_random_cluster(world, series);
+
+	return world;
+}
+
+// the random_scene field at night, lit by lamp_count small lamps floating over it, most of the
+// light reaching a point comes from a tiny part of its sky which is what path tracing alone
+// takes the most samples to find, past 8 lamps they share the power of 8 so the scene stays
+// as bright
+hittable_list lamps_scene(random_series* series, int lamp_count, GROUND ground)
+{
+	hittable_list world;
+	world.sky_intensity = 0;
+
+	add_ground(world, ground);
+
+	add_random_cluster(world, series);
+
+	auto lamp_power = real_t(120) * real_t(8) / real_t(std::max(8, lamp_count));
+	for (int i = 0; i < lamp_count; ++i)
+	{
+		point3 center(random_double(series, -8, 8), random_double(series, 0.6, 2.5), random_double(series, -6, 6));
+		auto emit = color::random(series, 0.5, 1) * lamp_power;
+		world.add(sphere{center, 0.1, world.add(emissive(emit))});
+	}
+
+	return world;
+}
+
+// instance_count copies of the random_scene cluster on a grid, each one rotated around y,
+// all of them share a single bottom level list
+hittable_list instanced_scene(random_series* series, int instance_count, GROUND ground)
+{
+	hittable_list world;
+
+	add_ground(world, ground);
 
-	world.prepare_soa();
+	auto cluster = make_shared<hittable_list>();
+	add_random_cluster(*cluster, series);
+	auto blas = world.add(cluster);
+
+	const real_t spacing = 24;
+	int side = int(ceil(sqrt(real_t(instance_count))));
+	for (int i = 0; i < instance_count; ++i)
+	{
+		auto x = (i % side - (side - 1) / real_t(2)) * spacing;
+		auto z = (i / side - (side - 1) / real_t(2)) * spacing;
+		auto t = transform_translate(vec3{x, 0, z}) * transform_rotate_y(random_double(series, 0, 360));
+		world.add(instance{blas, t});
+	}
 
 	return world;
 }
@@ -184,11 +471,96 @@ hittable_list aras_scene(random_series* series)
 
 	world.add(sphere{point3(1.5,1.5,-2), 0.3, world.add(lambertian(color(0.1,0.2,0.5)))});
 
-	world.prepare_soa();
+	return world;
+}
+
+// a bigger version of the random_scene field with sphere_count small spheres spread
+// over a square with about one sphere per unit area, used to benchmark large scenes
+// the spheres share a fixed palette of materials to keep millions of them affordable
+hittable_list field_scene(random_series* series, int sphere_count, GROUND ground)
+{
+	hittable_list world;
+
+	add_ground(world, ground);
+
+	const int palette_size = 256;
+	int palette_first = int(world.materials.size());
+	for (int i = 0; i < palette_size; ++i)
+	{
+		auto choose_mat = random_double(series);
+		if (choose_mat < 0.8)
+			world.add(lambertian(color::random(series) * color::random(series)));
+		else if (choose_mat < 0.95)
+			world.add(metal(color::random(series, 0.5, 1), random_double(series, 0, 0.5)));
+		else
+			world.add(dielectric(1.5));
+	}
+
+	world.spheres.reserve(sphere_count + 1);
+	auto half_side = real_t(0.5) * sqrt(real_t(sphere_count));
+	for (int i = 0; i < sphere_count; ++i)
+	{
+		point3 center(random_double(series, -half_side, half_side), 0.2, random_double(series, -half_side, half_side));
+		auto sphere_material = palette_first + int(xor_shift_32_rand(series) % palette_size);
+		world.add(sphere{center, 0.2, sphere_material});
+	}
 
 	return world;
 }
 
+// per pixel sample counts driven by the noise of the pixel, every pixel of a tile takes
+// min_samples and then keeps taking samples until its count reaches its standard deviation
+// over threshold or max_samples, samples in proportion to the deviation give the lowest mean
+// squared error for the rays spent while stopping every pixel at the same error spends them
+// in proportion to the variance and saves nothing over uniform sampling
+struct adaptive_sampling
+{
+	bool enabled = false;
+	int min_samples = 16;
+	int max_samples = 128;
+	real_t threshold = 0.003;
+};
+
+// the deviation is estimated on the gamma corrected pixel, where the image is compared, from the
+// luminance variance scaled by the slope of the square root at the mean, dark pixels take the
+// slope at this mean so that it doesn't blow up near 0
+constexpr real_t ADAPTIVE_MIN_MEAN = 0.05;
+
+// running mean and variance (Welford), stable in float however many samples are added
+struct welford
+{
+	int count;
+	real_t mean;
+	real_t m2;
+
+	void add(real_t x)
+	{
+		++count;
+		auto delta = x - mean;
+		mean += delta / real_t(count);
+		m2 += delta * (x - mean);
+	}
+
+	real_t variance() const
+	{
+		return count > 1 ? m2 / real_t(count - 1) : 0;
+	}
+};
+
+// samples of a pixel traced so far in adaptive mode
+struct adaptive_pixel
+{
+	color sum;
+	aov_sample aovs;
+	welford luminance;
+
+	// variance of a sample of the gamma corrected pixel
+	real_t display_variance() const
+	{
+		return luminance.variance() / (4 * std::max(luminance.mean, ADAPTIVE_MIN_MEAN));
+	}
+};
+
 struct ImageTile
 {
 	int startX, startY;
@@ -202,9 +574,25 @@ struct RaytraceTask: public enki::ITaskSet
 	hittable_list* world;
 	int samples_per_pixel;
 	int max_depth;
+	// primary rays traced together as one packet, 0 traces every ray on its own
+	int packet_size;
+	// recursive, iterative or nee, the wavefront integrator doesn't go through here
+	INTEGRATOR integrator;
+	adaptive_sampling adaptive;
+	// samples every pixel took, filled in adaptive mode
+	std::vector<int>* sample_counts;
+	// add the samples to the image accumulation instead of writing the pixels
+	bool accumulate;
+	sampler::KIND sampler_kind;
+	// index of the first sample of this render in the sobol sequence of every pixel
+	uint32_t first_sample;
 	std::vector<ImageTile> tasks;
 	std::vector<random_series> random_series;
 	std::vector<raytrace_stat> stats;
+	// camera rays of the tile a thread is working on
+	std::vector<camera_ray_batch> camera_rays;
+	// pixels of the tile a thread is sampling adaptively
+	std::vector<std::vector<adaptive_pixel>> adaptive_pixels;
 
 	void ExecuteRange(enki::TaskSetPartition range, uint32_t thread_ix) override
 	{
@@ -213,68 +601,282 @@ struct RaytraceTask: public enki::ITaskSet
 		for (uint32_t r = range.start; r < range.end; ++r)
 		{
 			auto& tile = tasks[r];
+			if (adaptive.enabled)
+			{
+				trace_tile_adaptive(tile, thread_ix);
+				continue;
+			}
+
+			auto& batch = camera_rays[thread_ix];
+			if (sampler_kind == sampler::KIND_SOBOL)
+			{
+				cam->get_sobol_rays(first_sample, tile.startX, tile.startY, tile.endX, tile.endY, samples_per_pixel, img->width, img->height, batch);
+			}
+			else
+			{
+				auto camera_series = random_series_x4_seed(xor_shift_32_rand(series), 0);
+				cam->get_rays(&camera_series, tile.startX, tile.startY, tile.endX, tile.endY, samples_per_pixel, img->width, img->height, batch);
+			}
+			if (packet_size > 0)
+			{
+				trace_tile_packets(tile, thread_ix);
+				continue;
+			}
+
+			size_t k = 0;
 			for (int j = tile.startY; j < tile.endY; ++j)
 			{
 				for (int i = tile.startX; i < tile.endX; ++i)
 				{
 					color pixel_color{0, 0, 0};
+					aov_sample pixel_aovs{};
 					for (int s = 0; s < samples_per_pixel; ++s)
 					{
-						auto u = (i + random_double(series)) / (img->width - 1);
-						auto v = (j + random_double(series)) / (img->height - 1);
-						auto r = cam->get_ray(series, u, v);
-						pixel_color += ray_color(series, r, *world, max_depth, stat);
+						auto r = batch.get_ray(k++);
+						auto smp = path_sampler(thread_ix, i, j, first_sample + uint32_t(s));
+						pixel_color += trace(thread_ix, &smp, r, pixel_aovs);
+						++stat.ray_count;
+					}
+
+					store_pixel(i, j, pixel_color);
+					store_aovs(i, j, pixel_aovs, samples_per_pixel);
+				}
+			}
+		}
+	}
+
+	// sum is the sum of the samples_per_pixel samples of the pixel
+	void store_pixel(int i, int j, const color& sum)
+	{
+		if (accumulate)
+			img->accumulation[j * img->width + i] += sum;
+		else
+			(*img)(i, j) = sqrt(sum / real_t(samples_per_pixel));
+	}
+
+	// aovs is the sum of the first hits of count camera rays of the pixel
+	void store_aovs(int i, int j, const aov_sample& sum, int count)
+	{
+		if (img->has_aovs())
+			img->store_aovs(size_t(j) * img->width + i, sum, count, accumulate ? int(first_sample) : 0);
+	}
+
+	// sampler of the bounces of sample `index` of pixel (i, j)
+	sampler path_sampler(uint32_t thread_ix, int i, int j, uint32_t index)
+	{
+		if (sampler_kind == sampler::KIND_SOBOL)
+			return sobol_sampler(uint32_t(j * img->width + i), index);
+		return random_sampler(&random_series[thread_ix]);
+	}
+
+	// color of camera ray r, the aovs of its first hit and its luminance are added to aovs when
+	// the image takes them
+	color trace(uint32_t thread_ix, sampler* smp, const ray& r, aov_sample& aovs)
+	{
+		hit_record rec;
+		bool hit = world->closest_hit(r, 0.001, infinity, rec);
+		auto c = shade_with(thread_ix, smp, r, hit, rec);
+		if (img->has_aovs())
+		{
+			aovs += first_hit_aovs(*world, r, hit, rec);
+			aovs.add_luminance(c);
+		}
+		return c;
+	}
+
+	// color of camera ray r whose closest hit is already known
+	color shade_with(uint32_t thread_ix, sampler* smp, const ray& r, bool hit, const hit_record& rec)
+	{
+		auto& stat = stats[thread_ix];
+		switch (integrator)
+		{
+		case INTEGRATOR_ITERATIVE: return shade_iterative(smp, r, hit, rec, *world, max_depth, stat);
+		case INTEGRATOR_NEE: return shade_nee(smp, r, hit, rec, *world, max_depth, stat);
+		default: return shade(smp, r, hit, rec, *world, max_depth, stat);
+		}
+	}
+
+	// every pixel of the tile takes adaptive.min_samples camera rays first, then each one goes on
+	// in rounds until its sample count covers its deviation, a few samples often miss the rare
+	// bright paths of a pixel so its variance is pulled towards the mean variance of the tile
+	// with the weight of min_samples samples, a pixel that saw no noise yet keeps sampling as
+	// long as its neighbours are noisy, packets aren't used since the pixels of a block stop at
+	// different sample counts
+	void trace_tile_adaptive(const ImageTile& tile, uint32_t thread_ix)
+	{
+		auto series = &random_series[thread_ix];
+		auto& batch = camera_rays[thread_ix];
+		auto camera_series = random_series_x4_seed(xor_shift_32_rand(series), 0);
+		auto tile_width = tile.endX - tile.startX;
+		auto& pixels = adaptive_pixels[thread_ix];
+		pixels.assign(size_t(tile_width) * size_t(tile.endY - tile.startY), adaptive_pixel{});
+
+		auto trace_samples = [&](int i, int j, int count) {
+			auto& pixel = pixels[size_t(j - tile.startY) * tile_width + (i - tile.startX)];
+			auto first = uint32_t(pixel.luminance.count);
+			if (sampler_kind == sampler::KIND_SOBOL)
+				cam->get_sobol_rays(first, i, j, i + 1, j + 1, count, img->width, img->height, batch);
+			else
+				cam->get_rays(&camera_series, i, j, i + 1, j + 1, count, img->width, img->height, batch);
+			for (int s = 0; s < count; ++s)
+			{
+				auto smp = path_sampler(thread_ix, i, j, first + uint32_t(s));
+				auto c = trace(thread_ix, &smp, batch.get_ray(s), pixel.aovs);
+				pixel.sum += c;
+				pixel.luminance.add(luminance(c));
+				++stats[thread_ix].ray_count;
+			}
+		};
+
+		real_t tile_variance = 0;
+		for (int j = tile.startY; j < tile.endY; ++j)
+			for (int i = tile.startX; i < tile.endX; ++i)
+				trace_samples(i, j, adaptive.min_samples);
+		for (const auto& pixel: pixels)
+			tile_variance += pixel.display_variance();
+		tile_variance /= real_t(pixels.size());
+
+		auto prior_weight = real_t(adaptive.min_samples);
+		for (int j = tile.startY; j < tile.endY; ++j)
+		{
+			for (int i = tile.startX; i < tile.endX; ++i)
+			{
+				auto& pixel = pixels[size_t(j - tile.startY) * tile_width + (i - tile.startX)];
+				while (pixel.luminance.count < adaptive.max_samples)
+				{
+					auto n = real_t(pixel.luminance.count - 1);
+					auto variance = (n * pixel.display_variance() + prior_weight * tile_variance) / (n + prior_weight);
+					auto target = std::min(real_t(adaptive.max_samples), sqrt(variance) / adaptive.threshold);
+					if (real_t(pixel.luminance.count) >= target)
+						break;
+					trace_samples(i, j, std::min(adaptive.min_samples, int(ceil(target)) - pixel.luminance.count));
+				}
+
+				(*sample_counts)[j * img->width + i] = pixel.luminance.count;
+				(*img)(i, j) = sqrt(pixel.sum / real_t(pixel.luminance.count));
+				store_aovs(i, j, pixel.aovs, pixel.luminance.count);
+			}
+		}
+	}
+
+	// the tile is walked in blocks of packet_size pixels, every sample of the block is one
+	// packet of primary rays intersected together then each ray bounces on its own, the
+	// camera rays of the tile are already in camera_rays
+	void trace_tile_packets(const ImageTile& tile, uint32_t thread_ix)
+	{
+		auto& stat = stats[thread_ix];
+		const auto& batch = camera_rays[thread_ix];
+		auto tile_width = tile.endX - tile.startX;
+
+		int block_width = 1;
+		while (block_width * block_width < packet_size)
+			block_width *= 2;
+		int block_height = packet_size / block_width;
+
+		ray rays[RAY_PACKET_MAX_SIZE];
+		bool hits[RAY_PACKET_MAX_SIZE];
+		hit_record recs[RAY_PACKET_MAX_SIZE];
+		color pixel_colors[RAY_PACKET_MAX_SIZE];
+		aov_sample pixel_aovs[RAY_PACKET_MAX_SIZE];
+		int pixel_x[RAY_PACKET_MAX_SIZE];
+		int pixel_y[RAY_PACKET_MAX_SIZE];
+		size_t pixel_ray[RAY_PACKET_MAX_SIZE];
+
+		for (int block_y = tile.startY; block_y < tile.endY; block_y += block_height)
+		{
+			for (int block_x = tile.startX; block_x < tile.endX; block_x += block_width)
+			{
+				int count = 0;
+				for (int j = block_y; j < block_y + block_height && j < tile.endY; ++j)
+				{
+					for (int i = block_x; i < block_x + block_width && i < tile.endX; ++i)
+					{
+						pixel_x[count] = i;
+						pixel_y[count] = j;
+						pixel_ray[count] = size_t((j - tile.startY) * tile_width + (i - tile.startX)) * samples_per_pixel;
+						pixel_colors[count] = color{0, 0, 0};
+						pixel_aovs[count] = aov_sample{};
+						++count;
+					}
+				}
+
+				for (int s = 0; s < samples_per_pixel; ++s)
+				{
+					for (int k = 0; k < count; ++k)
+						rays[k] = batch.get_ray(pixel_ray[k] + s);
+
+					world->closest_hit_packet(rays, count, 0.001, infinity, hits, recs);
+					for (int k = 0; k < count; ++k)
+					{
+						auto smp = path_sampler(thread_ix, pixel_x[k], pixel_y[k], first_sample + uint32_t(s));
+						auto c = shade_with(thread_ix, &smp, rays[k], hits[k], recs[k]);
+						if (img->has_aovs())
+						{
+							pixel_aovs[k] += first_hit_aovs(*world, rays[k], hits[k], recs[k]);
+							pixel_aovs[k].add_luminance(c);
+						}
+						pixel_colors[k] += c;
 						++stat.ray_count;
 					}
+				}
 
-					auto scale = 1.0 / samples_per_pixel;
-					(*img)(i, j) = sqrt(pixel_color * scale);
+				for (int k = 0; k < count; ++k)
+				{
+					store_pixel(pixel_x[k], pixel_y[k], pixel_colors[k]);
+					store_aovs(pixel_x[k], pixel_y[k], pixel_aovs[k], samples_per_pixel);
 				}
 			}
 		}
 	}
 };
 
-int main()
+struct render_result
 {
-	enki::TaskScheduler ts;
-	ts.Initialize();
-
-	// Image
-	const auto aspect_ratio = 16.0 / 9.0;
-	const int image_width = 640;
-	const int image_height = static_cast<int>(image_width / aspect_ratio);
-	const int samples_per_pixel = 10;
-	const int max_depth = 50;
+	raytrace_stat stat;
+	real_t elapsed_ms;
+	// samples of every pixel, empty unless the samples are adaptive
+	std::vector<int> sample_counts;
 
-	// World
-	random_series global_random_series{42};
-	auto world = random_scene(&global_random_series);
+	real_t mrays_per_second() const
+	{
+		auto rays_count = stat.ray_count + stat.bounces + stat.shadow_rays;
+		return (real_t(rays_count) / (elapsed_ms / 1000.0)) / 1000'000.0;
+	}
 
-	// Camera
-	point3 lookfrom(13, 2, 3);
-	point3 lookat(0, 0, 0);
-	vec3 vup(0, 1, 0);
-	auto dist_to_focus = 10;
-	auto aperture = 0.1;
-	camera cam(lookfrom, lookat, vup, 20, aspect_ratio, aperture, dist_to_focus);
-	// camera cam(point3(0, 2, 3), point3(0, 0, 0), vec3(0, 1, 0), 60, aspect_ratio, aperture, 3);
+	// rays traced per camera ray
+	real_t average_path_length() const
+	{
+		return real_t(stat.ray_count + stat.bounces) / real_t(stat.ray_count);
+	}
+};
 
-	image img{image_width, image_height};
+render_result render(enki::TaskScheduler& ts, image& img, camera& cam, hittable_list& world, int samples_per_pixel, int max_depth, int packet_size, INTEGRATOR integrator, const adaptive_sampling& adaptive, bool accumulate, sampler::KIND sampler_kind, random_series series)
+{
+	render_result result{};
+	if (adaptive.enabled)
+		result.sample_counts.assign(size_t(img.width) * size_t(img.height), 0);
 
 	int tileSizeX = 16;
 	int tileSizeY = 16;
 	int tileCountX = 1 + ((img.width - 1) / tileSizeX);
 	int tileCountY = 1 + ((img.height - 1) / tileSizeY);
 
-	int tileTotalCount = tileCountX * tileCountY;
-
 	RaytraceTask job{};
 	job.img = &img;
 	job.cam = &cam;
 	job.world = &world;
 	job.samples_per_pixel = samples_per_pixel;
 	job.max_depth = max_depth;
+	job.packet_size = packet_size;
+	job.integrator = integrator;
+	job.adaptive = adaptive;
+	job.sample_counts = &result.sample_counts;
+	job.accumulate = accumulate;
+	job.sampler_kind = sampler_kind;
+	// a progressive pass goes on with the samples after the ones already accumulated
+	job.first_sample = accumulate ? uint32_t(img.accumulated_samples) : 0;
+	job.camera_rays.resize(parallel_thread_count(&ts));
+	job.adaptive_pixels.resize(parallel_thread_count(&ts));
 
 	for (int x = 0; x < tileCountX; ++x)
 	{
@@ -294,7 +896,7 @@ int main()
 			tile.startY = startY;
 			tile.endY = endY;
 			job.tasks.push_back(tile);
-			job.random_series.push_back(random_series{xor_shift_32_rand(&global_random_series)});
+			job.random_series.push_back(random_series{xor_shift_32_rand(&series)});
 			job.stats.push_back(raytrace_stat{});
 		}
 	}
@@ -306,22 +908,1216 @@ int main()
 	ts.WaitforTask(&job);
 
 	auto end = std::chrono::high_resolution_clock::now();
-	std::chrono::duration<real_t, std::milli> pixel_only = end - start;
 
-	raytrace_stat global_stat{};
+	result.elapsed_ms = std::chrono::duration<real_t, std::milli>(end - start).count();
 	for (auto& s: job.stats)
 	{
-		global_stat.ray_count += s.ray_count;
-		global_stat.bounces += s.bounces;
+		result.stat.ray_count += s.ray_count;
+		result.stat.bounces += s.bounces;
+		result.stat.roulette_terminations += s.roulette_terminations;
+		result.stat.shadow_rays += s.shadow_rays;
 	}
+	return result;
+}
 
-	img.write(std::cout);
-	std::cerr << "\nDone.\n";
+static const char* ACCEL_NAMES[] = {"linear", "bvh", "bvh_wide", "bvh_quantized", "grid"};
+static const char* BUILDER_NAMES[] = {"sah", "lbvh"};
 
-	std::cerr << "Elapsed time: " << std::chrono::duration<real_t, std::milli>(end - start).count() << "ms\n";
-	std::cerr << "Total Rays: " << real_t(global_stat.ray_count) / real_t(1000'000.0) << " MRays, Bounces: " << real_t(global_stat.bounces) / real_t(1000'000.0) << " MRays\n";
-	auto rays_count = global_stat.ray_count + global_stat.bounces;
-	std::cerr << "Ray Per Sec: " << (real_t(rays_count) / (real_t(pixel_only.count()) / 1000.0)) / 1000'000.0 << " MRays/Second\n";
+static const char* INTEGRATOR_NAMES[] = {"recursive", "iterative", "wavefront", "nee"};
+static const char* SAMPLER_NAMES[] = {"random", "sobol"};
+static const char* LIGHT_PICK_NAMES[] = {"uniform", "tree"};
+static const char* GROUND_NAMES[] = {"sphere", "plane"};
+static const char* SCENE_NAMES[] = {"random", "aras", "field", "instanced", "lamps"};
 
-	return 0;
-}
\ No newline at end of file
+static const char* USAGE = "usage: rtow [--scene random|aras|field|instanced|lamps] [--spheres N] [--instances N] [--lamps N] [--ground sphere|plane] [--accel linear|bvh|bvh_wide|bvh_quantized|grid] [--builder sah|lbvh] [--compare-accel] [--compare-integrator] [--frames N] [--rebuild-threshold X] [--cache DIR] [--packet-size N] [--integrator recursive|iterative|wavefront|nee] [--reorder-batch N] [--reorder-benchmark] [--rng-benchmark] [--sampling-benchmark] [--sampler random|sobol] [--sampler-benchmark] [--nee-benchmark] [--light-pick uniform|tree] [--light-benchmark] [--reference-spp N] [--denoise] [--denoise-iterations N] [--aovs] [--denoise-benchmark] [--adaptive] [--adaptive-min N] [--adaptive-max N] [--adaptive-threshold X] [--adaptive-benchmark] [--heatmap FILE] [--progressive] [--pass-samples N] [--target-spp N] [--time-budget MS] [--snapshot-interval MS] [--snapshot FILE]\n";
+
+// index of name in names, a name that isn't there prints the valid ones and the usage and
+// exits rather than falling back to the default and measuring something else
+template <size_t N>
+int parse_name(const char* option, const char* name, const char* (&names)[N])
+{
+	for (size_t n = 0; n < N; ++n)
+		if (strcmp(name, names[n]) == 0)
+			return int(n);
+	std::cerr << "unknown value '" << name << "' for " << option << ", it should be one of";
+	for (size_t n = 0; n < N; ++n)
+		std::cerr << " " << names[n];
+	std::cerr << "\n" << USAGE;
+	exit(EXIT_FAILURE);
+}
+
+struct settings
+{
+	const char* scene = "random";
+	int sphere_count = 100'000;
+	int lamp_count = 8;
+	int instance_count = 100;
+	// ground of every scene but aras
+	GROUND ground = GROUND_SPHERE;
+	hittable_list::ACCEL accel = hittable_list::ACCEL_BVH_WIDE;
+	hittable_list::BUILDER builder = hittable_list::BUILDER_SAH;
+	// render once per accelerator and compare their speed
+	bool compare_accel = false;
+	// render once per integrator and compare their speed and path length
+	bool compare_integrator = false;
+	// animation length, every frame moves the spheres and refits the bvh
+	int frames = 0;
+	real_t rebuild_threshold = 1.5;
+	// directory of the acceleration structure cache, empty disables it
+	const char* cache_dir = "";
+	// primary rays per packet, a power of 2 up to RAY_PACKET_MAX_SIZE, 0 disables packets
+	int packet_size = 16;
+	INTEGRATOR integrator = INTEGRATOR_RECURSIVE;
+	// wavefront rays per sorted batch of secondary rays, 0 traces them in the order they come
+	int reorder_batch = 0;
+	// render with and without the secondary ray sort and compare every bounce
+	bool reorder_benchmark = false;
+	// measure the random number generators and exit
+	bool rng_benchmark = false;
+	// measure the direction, ball and disk mappings, test how evenly they cover their domain
+	// and exit
+	bool sampling_benchmark = false;
+	sampler::KIND sampler_kind = sampler::KIND_RANDOM;
+	// error against a reference_samples render of every sampler at 1 to 64 samples per pixel
+	bool sampler_benchmark = false;
+	// same with the iterative integrator against nee
+	bool nee_benchmark = false;
+	hittable_list::LIGHT_PICK light_pick = hittable_list::LIGHT_PICK_TREE;
+	// light tree build time and nee error per ray with every way of picking the lights
+	bool light_benchmark = false;
+	int reference_samples = 1024;
+	// filter the image guided by its first hit aovs once it's rendered, see denoise.h
+	bool denoise = false;
+	int denoise_iterations = 5;
+	// write the aovs as albedo.ppm, normal.ppm and depth.ppm
+	bool write_aovs = false;
+	// error of a few samples per pixel denoised against more samples per pixel without
+	bool denoise_benchmark = false;
+	adaptive_sampling adaptive;
+	// error of an adaptive render against the uniform samples per pixel with the same error
+	bool adaptive_benchmark = false;
+	// where the adaptive sample counts are written as an image
+	const char* heatmap_path = "samples.ppm";
+	// render in passes of pass_samples samples per pixel into the image accumulation until
+	// target_samples (0 for the default samples per pixel) or the time budget (0 for none) is
+	// reached, a snapshot is written every snapshot_interval_ms (0 after every pass)
+	bool progressive = false;
+	int pass_samples = 1;
+	int target_samples = 0;
+	real_t time_budget_ms = 0;
+	real_t snapshot_interval_ms = 0;
+	const char* snapshot_path = "snapshot.ppm";
+};
+
+settings parse_settings(int argc, char** argv)
+{
+	settings self{};
+	for (int i = 1; i < argc; ++i)
+	{
+		auto arg = argv[i];
+		auto has_value = i + 1 < argc;
+		if (strcmp(arg, "--scene") == 0 && has_value)
+		{
+			self.scene = SCENE_NAMES[parse_name(arg, argv[++i], SCENE_NAMES)];
+		}
+		else if (strcmp(arg, "--spheres") == 0 && has_value)
+		{
+			self.sphere_count = atoi(argv[++i]);
+		}
+		else if (strcmp(arg, "--instances") == 0 && has_value)
+		{
+			self.instance_count = atoi(argv[++i]);
+		}
+		else if (strcmp(arg, "--lamps") == 0 && has_value)
+		{
+			self.lamp_count = atoi(argv[++i]);
+		}
+		else if (strcmp(arg, "--ground") == 0 && has_value)
+		{
+			self.ground = GROUND(parse_name(arg, argv[++i], GROUND_NAMES));
+		}
+		else if (strcmp(arg, "--accel") == 0 && has_value)
+		{
+			self.accel = hittable_list::ACCEL(parse_name(arg, argv[++i], ACCEL_NAMES));
+		}
+		else if (strcmp(arg, "--builder") == 0 && has_value)
+		{
+			self.builder = hittable_list::BUILDER(parse_name(arg, argv[++i], BUILDER_NAMES));
+		}
+		else if (strcmp(arg, "--frames") == 0 && has_value)
+		{
+			self.frames = atoi(argv[++i]);
+		}
+		else if (strcmp(arg, "--rebuild-threshold") == 0 && has_value)
+		{
+			self.rebuild_threshold = real_t(atof(argv[++i]));
+		}
+		else if (strcmp(arg, "--cache") == 0 && has_value)
+		{
+			self.cache_dir = argv[++i];
+		}
+		else if (strcmp(arg, "--packet-size") == 0 && has_value)
+		{
+			self.packet_size = atoi(argv[++i]);
+			if (self.packet_size < 0 || self.packet_size > RAY_PACKET_MAX_SIZE || (self.packet_size & (self.packet_size - 1)) != 0)
+			{
+				std::cerr << "packet size should be a power of 2 up to " << RAY_PACKET_MAX_SIZE << " or 0\n";
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if (strcmp(arg, "--integrator") == 0 && has_value)
+		{
+			self.integrator = INTEGRATOR(parse_name(arg, argv[++i], INTEGRATOR_NAMES));
+		}
+		else if (strcmp(arg, "--sampler") == 0 && has_value)
+		{
+			self.sampler_kind = sampler::KIND(parse_name(arg, argv[++i], SAMPLER_NAMES));
+		}
+		else if (strcmp(arg, "--reference-spp") == 0 && has_value)
+		{
+			self.reference_samples = atoi(argv[++i]);
+		}
+		else if (strcmp(arg, "--reorder-batch") == 0 && has_value)
+		{
+			self.reorder_batch = atoi(argv[++i]);
+			if (self.reorder_batch < 0)
+			{
+				std::cerr << "reorder batch should be positive or 0\n";
+				exit(EXIT_FAILURE);
+			}
+		}
+		else if (strcmp(arg, "--adaptive") == 0)
+		{
+			self.adaptive.enabled = true;
+		}
+		else if (strcmp(arg, "--adaptive-min") == 0 && has_value)
+		{
+			self.adaptive.min_samples = atoi(argv[++i]);
+		}
+		else if (strcmp(arg, "--adaptive-max") == 0 && has_value)
+		{
+			self.adaptive.max_samples = atoi(argv[++i]);
+		}
+		else if (strcmp(arg, "--adaptive-benchmark") == 0)
+		{
+			self.adaptive_benchmark = true;
+		}
+		else if (strcmp(arg, "--adaptive-threshold") == 0 && has_value)
+		{
+			self.adaptive.threshold = real_t(atof(argv[++i]));
+		}
+		else if (strcmp(arg, "--heatmap") == 0 && has_value)
+		{
+			self.heatmap_path = argv[++i];
+		}
+		else if (strcmp(arg, "--progressive") == 0)
+		{
+			self.progressive = true;
+		}
+		else if (strcmp(arg, "--pass-samples") == 0 && has_value)
+		{
+			self.pass_samples = atoi(argv[++i]);
+		}
+		else if (strcmp(arg, "--target-spp") == 0 && has_value)
+		{
+			self.target_samples = atoi(argv[++i]);
+		}
+		else if (strcmp(arg, "--time-budget") == 0 && has_value)
+		{
+			self.time_budget_ms = real_t(atof(argv[++i]));
+		}
+		else if (strcmp(arg, "--snapshot-interval") == 0 && has_value)
+		{
+			self.snapshot_interval_ms = real_t(atof(argv[++i]));
+		}
+		else if (strcmp(arg, "--snapshot") == 0 && has_value)
+		{
+			self.snapshot_path = argv[++i];
+		}
+		else if (strcmp(arg, "--compare-accel") == 0)
+		{
+			self.compare_accel = true;
+		}
+		else if (strcmp(arg, "--compare-integrator") == 0)
+		{
+			self.compare_integrator = true;
+		}
+		else if (strcmp(arg, "--reorder-benchmark") == 0)
+		{
+			self.reorder_benchmark = true;
+		}
+		else if (strcmp(arg, "--rng-benchmark") == 0)
+		{
+			self.rng_benchmark = true;
+		}
+		else if (strcmp(arg, "--sampling-benchmark") == 0)
+		{
+			self.sampling_benchmark = true;
+		}
+		else if (strcmp(arg, "--sampler-benchmark") == 0)
+		{
+			self.sampler_benchmark = true;
+		}
+		else if (strcmp(arg, "--nee-benchmark") == 0)
+		{
+			self.nee_benchmark = true;
+		}
+		else if (strcmp(arg, "--light-pick") == 0 && has_value)
+		{
+			self.light_pick = hittable_list::LIGHT_PICK(parse_name(arg, argv[++i], LIGHT_PICK_NAMES));
+		}
+		else if (strcmp(arg, "--light-benchmark") == 0)
+		{
+			self.light_benchmark = true;
+		}
+		else if (strcmp(arg, "--denoise") == 0)
+		{
+			self.denoise = true;
+		}
+		else if (strcmp(arg, "--denoise-iterations") == 0 && has_value)
+		{
+			self.denoise_iterations = atoi(argv[++i]);
+		}
+		else if (strcmp(arg, "--aovs") == 0)
+		{
+			self.write_aovs = true;
+		}
+		else if (strcmp(arg, "--denoise-benchmark") == 0)
+		{
+			self.denoise_benchmark = true;
+		}
+		else
+		{
+			std::cerr << "unknown argument '" << arg << "'\n";
+			std::cerr << USAGE;
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (self.adaptive.enabled && (self.adaptive.min_samples < 2 || self.adaptive.max_samples < self.adaptive.min_samples))
+	{
+		std::cerr << "adaptive sampling needs at least 2 min samples and max samples >= min samples\n";
+		exit(EXIT_FAILURE);
+	}
+	if (self.progressive && (self.adaptive.enabled || self.pass_samples < 1))
+	{
+		std::cerr << "progressive rendering needs at least 1 sample per pass and doesn't work with adaptive sampling\n";
+		exit(EXIT_FAILURE);
+	}
+	return self;
+}
+
+// renders with the integrator the settings ask for, the wavefront one also reports its stages
+render_result render_with(enki::TaskScheduler& ts, image& img, camera& cam, hittable_list& world, int samples_per_pixel, int max_depth, const settings& config, random_series series, wavefront_stats* stage_stats = nullptr, bool accumulate = false)
+{
+	if (config.integrator != INTEGRATOR_WAVEFRONT)
+		return render(ts, img, cam, world, samples_per_pixel, max_depth, config.packet_size, config.integrator, config.adaptive, accumulate, config.sampler_kind, series);
+
+	wavefront_integrator integrator{&ts, &img, &cam, &world, samples_per_pixel, max_depth, uint32_t(config.reorder_batch)};
+	integrator.accumulate = accumulate;
+	integrator.sampler_kind = config.sampler_kind;
+	auto stats = integrator.render(series);
+	if (stage_stats)
+		*stage_stats = stats;
+
+	render_result result{};
+	result.elapsed_ms = stats.elapsed_ms;
+	result.stat.ray_count = stats.ray_count;
+	result.stat.bounces = stats.bounces;
+	return result;
+}
+
+#if SIMD
+// the whole loop is built for avx2 so that random_float_x8 is inlined into it
+RANDOM_AVX2 static double
+random_series_x8_sum(int count)
+{
+	auto series = random_series_x8_seed(42, 0);
+	double sum[8]{};
+	for (int i = 0; i < count; i += 8)
+	{
+		real_t f[8];
+		random_float_x8(&series, f);
+		for (int k = 0; k < 8; ++k)
+			sum[k] += f[k];
+	}
+	double total = 0;
+	for (int k = 0; k < 8; ++k)
+		total += sum[k];
+	return total;
+}
+#endif
+
+// floats per second of the scalar random_series against the simd and ispc streams, every
+// generator sums what it draws so that the mean doubles as a sanity check
+void rng_benchmark()
+{
+	const int count = 1 << 26;
+	auto report = [&](const char* name, auto&& func) {
+		auto start = std::chrono::high_resolution_clock::now();
+		double sum = func();
+		auto end = std::chrono::high_resolution_clock::now();
+		auto ms = std::chrono::duration<real_t, std::milli>(end - start).count();
+		std::cerr << name << ": " << ms << "ms, " << (real_t(count) / (ms / 1000.0)) / 1000'000.0 << " MFloats/Second, mean " << sum / count << "\n";
+	};
+
+	report("xor_shift_32_rand", [&] {
+		random_series series{random_seed(42, 0)};
+		double sum = 0;
+		for (int i = 0; i < count; ++i)
+			sum += random_double(&series);
+		return sum;
+	});
+
+	report("random_series_x4", [&] {
+		auto series = random_series_x4_seed(42, 0);
+		double sum[4]{};
+		for (int i = 0; i < count; i += 4)
+		{
+			real_t f[4];
+			random_float_x4(&series, f);
+			for (int k = 0; k < 4; ++k)
+				sum[k] += f[k];
+		}
+		return sum[0] + sum[1] + sum[2] + sum[3];
+	});
+
+#if SIMD
+	if (random_avx2_supported())
+		report("random_series_x8", [&] { return random_series_x8_sum(count); });
+	else
+		std::cerr << "random_series_x8: skipped, the cpu has no avx2\n";
+#endif
+
+	report("ispc random_float", [&] {
+		return ispc::random_float_sum(42, count);
+	});
+}
+
+// the rejection loop random_in_unit_disk used to be, for sampling_benchmark to compare against
+vec3 random_in_unit_disk_rejection(random_series* series)
+{
+	while (true)
+	{
+		auto p = vec3(random_double(series, -1, 1), random_double(series, -1, 1), 0);
+		if (p.length_squared() >= 1) continue;
+		return p;
+	}
+}
+
+// bin of a point of the unit disk, bands of equal area by r^2 times sectors of the angle
+int disk_bin(real_t x, real_t y, int bands, int sectors)
+{
+	auto band = std::min(int((x * x + y * y) * real_t(bands)), bands - 1);
+	auto sector = std::min(int((atan2(y, x) / (2 * pi) + real_t(0.5)) * real_t(sectors)), sectors - 1);
+	return band * sectors + std::max(sector, 0);
+}
+
+// bin of a direction, bands of z have equal area on the sphere
+int direction_bin(const vec3& v, int bands, int sectors)
+{
+	auto band = std::min(int((v.z() + 1) * real_t(0.5) * real_t(bands)), bands - 1);
+	auto sector = std::min(int((atan2(v.y(), v.x()) / (2 * pi) + real_t(0.5)) * real_t(sectors)), sectors - 1);
+	return std::max(band, 0) * sectors + std::max(sector, 0);
+}
+
+// draws count samples into bin_count equal area bins and compares their chi square against
+// the 99.9% point of the chi square distribution with bin_count - 1 degrees of freedom
+// (Wilson and Hilferty), a mapping that isn't uniform goes over it by far
+void uniformity_test(const char* name, int bin_count, int count, random_series series, int (*bin)(random_series*))
+{
+	std::vector<int> bins(bin_count, 0);
+	for (int i = 0; i < count; ++i)
+		++bins[bin(&series)];
+
+	auto expected = double(count) / double(bin_count);
+	double chi_square = 0;
+	for (auto observed: bins)
+		chi_square += (observed - expected) * (observed - expected) / expected;
+	auto dof = double(bin_count - 1);
+	auto h = 2 / (9 * dof);
+	auto bound = dof * pow(1 - h + 3.0902 * sqrt(h), 3);
+	std::cerr << name << ": chi square " << chi_square << ", " << dof << " dof, 99.9% bound " << bound
+		<< (chi_square <= bound ? ", uniform\n" : ", NOT uniform\n");
+}
+
+// the libm and the fast mappings of vec3.h, throughput of each over blocks of uniform numbers
+// drawn ahead so the mapping loop has nothing else in it, then how close the fast ones get to
+// the libm functions and how evenly both cover their domain
+void sampling_benchmark()
+{
+	const int count = 1 << 24;
+	const int block = 4096;
+	std::vector<real_t> u1(block), u2(block), u3(block);
+	auto report = [&](const char* name, auto&& func) {
+		random_series series{random_seed(42, 0)};
+		double sum = 0, ms = 0;
+		for (int first = 0; first < count; first += block)
+		{
+			for (int i = 0; i < block; ++i)
+			{
+				u1[i] = random_double(&series);
+				u2[i] = random_double(&series);
+				u3[i] = random_double(&series);
+			}
+			auto start = std::chrono::high_resolution_clock::now();
+			real_t block_sum = 0;
+			for (int i = 0; i < block; ++i)
+				block_sum += func(u1[i], u2[i], u3[i]);
+			auto end = std::chrono::high_resolution_clock::now();
+			ms += std::chrono::duration<double, std::milli>(end - start).count();
+			sum += block_sum;
+		}
+		std::cerr << name << ": " << ms << "ms, " << (double(count) / (ms / 1000.0)) / 1000'000.0 << " MSamples/Second, mean " << sum / count << "\n";
+	};
+
+	report("unit_vector precise", [](real_t a, real_t b, real_t) { auto v = unit_vector_sample_precise(a, b); return v.x() + v.y() + v.z(); });
+	report("unit_vector fast", [](real_t a, real_t b, real_t) { auto v = unit_vector_sample_fast(a, b); return v.x() + v.y() + v.z(); });
+	report("unit_sphere precise", [](real_t a, real_t b, real_t c) { auto v = unit_sphere_sample_precise(a, b, c); return v.x() + v.y() + v.z(); });
+	report("unit_sphere fast", [](real_t a, real_t b, real_t c) { auto v = unit_sphere_sample_fast(a, b, c); return v.x() + v.y() + v.z(); });
+	report("concentric_disk precise", [](real_t a, real_t b, real_t) { real_t x, y; concentric_disk_sample_precise(a, b, x, y); return x + y; });
+	report("concentric_disk fast", [](real_t a, real_t b, real_t) { real_t x, y; concentric_disk_sample_fast(a, b, x, y); return x + y; });
+	{
+		// the loop draws as many numbers as it needs so it's timed with its own draws
+		random_series series{random_seed(42, 0)};
+		double sum = 0;
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int i = 0; i < count; ++i)
+		{
+			auto p = random_in_unit_disk_rejection(&series);
+			sum += p.x() + p.y();
+		}
+		auto end = std::chrono::high_resolution_clock::now();
+		auto ms = std::chrono::duration<double, std::milli>(end - start).count();
+		std::cerr << "rejection disk (with its draws): " << ms << "ms, " << (double(count) / (ms / 1000.0)) / 1000'000.0 << " MSamples/Second, mean " << sum / count << "\n";
+	}
+
+	real_t sincos_error = 0, cbrt_error = 0, length_error = 0;
+	const int sweep = 1 << 20;
+	for (int i = 0; i <= sweep; ++i)
+	{
+		auto t = real_t(i) / real_t(sweep);
+		real_t s, c;
+		fast_sincos_turns(t, s, c);
+		sincos_error = max(sincos_error, max(fabs(s - sin(2 * pi * t)), fabs(c - cos(2 * pi * t))));
+		cbrt_error = max(cbrt_error, fabs(fast_cbrt(t) - cbrt(t)));
+		length_error = max(length_error, fabs(unit_vector_sample_fast(t, real_t(i % 997) / real_t(997)).length() - 1));
+	}
+	std::cerr << "fast_sincos_turns max error: " << sincos_error << ", fast_cbrt max error: " << cbrt_error
+		<< ", unit_vector fast max length error: " << length_error << "\n";
+
+	const int uniformity_count = 1 << 22;
+	random_series series{random_seed(7, 0)};
+	uniformity_test("unit_vector precise", 512, uniformity_count, series, [](random_series* s) {
+		auto u = random_double(s);
+		return direction_bin(unit_vector_sample_precise(u, random_double(s)), 16, 32);
+	});
+	uniformity_test("unit_vector fast", 512, uniformity_count, series, [](random_series* s) {
+		auto u = random_double(s);
+		return direction_bin(unit_vector_sample_fast(u, random_double(s)), 16, 32);
+	});
+	// shells of equal volume by r^3 times direction bins
+	uniformity_test("unit_sphere precise", 512, uniformity_count, series, [](random_series* s) {
+		auto u = random_double(s);
+		auto v = random_double(s);
+		auto p = unit_sphere_sample_precise(u, v, random_double(s));
+		auto r = p.length();
+		auto shell = std::min(int(r * r * r * 8), 7);
+		return shell * 64 + direction_bin(p / max(r, real_t(1e-30)), 8, 8);
+	});
+	uniformity_test("unit_sphere fast", 512, uniformity_count, series, [](random_series* s) {
+		auto u = random_double(s);
+		auto v = random_double(s);
+		auto p = unit_sphere_sample_fast(u, v, random_double(s));
+		auto r = p.length();
+		auto shell = std::min(int(r * r * r * 8), 7);
+		return shell * 64 + direction_bin(p / max(r, real_t(1e-30)), 8, 8);
+	});
+	uniformity_test("concentric_disk precise", 512, uniformity_count, series, [](random_series* s) {
+		auto u = random_double(s);
+		real_t x, y;
+		concentric_disk_sample_precise(u, random_double(s), x, y);
+		return disk_bin(x, y, 16, 32);
+	});
+	uniformity_test("concentric_disk fast", 512, uniformity_count, series, [](random_series* s) {
+		auto u = random_double(s);
+		real_t x, y;
+		concentric_disk_sample_fast(u, random_double(s), x, y);
+		return disk_bin(x, y, 16, 32);
+	});
+}
+
+// root mean square error of the displayed values of a against b, clamped to [0, 1] the way
+// they're written so that a few pixels of a directly visible light don't drown the rest
+real_t image_rmse(const image& a, const image& b)
+{
+	double sum = 0;
+	for (size_t i = 0; i < a.pixels.size(); ++i)
+	{
+		for (int c = 0; c < 3; ++c)
+		{
+			auto d = clamp(a.pixels[i][c], 0, 1) - clamp(b.pixels[i][c], 0, 1);
+			sum += d * d;
+		}
+	}
+	return real_t(sqrt(sum / double(a.pixels.size() * 3)));
+}
+
+// renders a quarter size image with both configs at 1 to 64 samples per pixel and measures
+// the error against a reference_config.reference_samples render
+void convergence_benchmark(enki::TaskScheduler& ts, int image_width, int image_height, camera& cam, hittable_list& world, int max_depth,
+	const settings& reference_config, const char* names[2], const settings configs[2], random_series series)
+{
+	const int LEVEL_COUNT = 7;
+
+	image reference{image_width / 4, image_height / 4};
+	auto reference_result = render_with(ts, reference, cam, world, reference_config.reference_samples, max_depth, reference_config, series);
+	std::cerr << "Reference: " << reference_config.reference_samples << " samples per pixel, " << reference_result.elapsed_ms << "ms\n";
+
+	image img{reference.width, reference.height};
+	real_t rmse[2][LEVEL_COUNT];
+	for (int level = 0; level < LEVEL_COUNT; ++level)
+	{
+		auto samples = 1 << level;
+		std::cerr << samples << " spp:";
+		for (int c = 0; c < 2; ++c)
+		{
+			auto result = render_with(ts, img, cam, world, samples, max_depth, configs[c], series);
+			rmse[c][level] = image_rmse(img, reference);
+			std::cerr << " " << names[c] << " RMSE " << rmse[c][level] << " (" << result.elapsed_ms << "ms)";
+		}
+		std::cerr << "\n";
+	}
+
+	// monte carlo error goes down as 1 / sqrt(spp) so the first config needs (its RMSE /
+	// the second's RMSE)^2 times the samples to get to the error of the second
+	for (int level = 0; level < LEVEL_COUNT; ++level)
+	{
+		auto ratio = rmse[0][level] / rmse[1][level];
+		auto first_samples = real_t(1 << level) * ratio * ratio;
+		std::cerr << names[1] << " " << (1 << level) << " spp: as good as " << names[0] << " at " << first_samples << " spp, "
+			<< (1 - real_t(1 << level) / first_samples) * 100 << "% fewer samples\n";
+	}
+}
+
+// random against sobol samples, the reference is sobol
+void sampler_benchmark(enki::TaskScheduler& ts, int image_width, int image_height, camera& cam, hittable_list& world, int max_depth, settings config, random_series series)
+{
+	config.adaptive.enabled = false;
+	config.progressive = false;
+	const char* names[2] = {SAMPLER_NAMES[sampler::KIND_RANDOM], SAMPLER_NAMES[sampler::KIND_SOBOL]};
+	settings configs[2] = {config, config};
+	configs[0].sampler_kind = sampler::KIND_RANDOM;
+	configs[1].sampler_kind = sampler::KIND_SOBOL;
+	convergence_benchmark(ts, image_width, image_height, cam, world, max_depth, configs[1], names, configs, series);
+}
+
+// path tracing alone against next event estimation, the reference is nee
+void nee_benchmark(enki::TaskScheduler& ts, int image_width, int image_height, camera& cam, hittable_list& world, int max_depth, settings config, random_series series)
+{
+	config.adaptive.enabled = false;
+	config.progressive = false;
+	const char* names[2] = {INTEGRATOR_NAMES[INTEGRATOR_ITERATIVE], INTEGRATOR_NAMES[INTEGRATOR_NEE]};
+	settings configs[2] = {config, config};
+	configs[0].integrator = INTEGRATOR_ITERATIVE;
+	configs[1].integrator = INTEGRATOR_NEE;
+	convergence_benchmark(ts, image_width, image_height, cam, world, max_depth, configs[1], names, configs, series);
+}
+
+// times the light tree build then renders a quarter size image with nee picking the lights
+// every way, the error against a reference_samples render with the tree times the rays traced
+// is the variance per ray, the lower the less time it takes to get to a given noise
+void light_benchmark(enki::TaskScheduler& ts, int image_width, int image_height, camera& cam, hittable_list& world, int samples_per_pixel, int max_depth, settings config, random_series series)
+{
+	config.integrator = INTEGRATOR_NEE;
+	config.adaptive.enabled = false;
+	config.progressive = false;
+	auto light_pick = world.light_pick;
+
+	auto build_start = std::chrono::high_resolution_clock::now();
+	auto tree = light_tree_build(world.lights);
+	auto build_end = std::chrono::high_resolution_clock::now();
+	std::cerr << "Light tree: " << world.lights.size() << " lights, " << tree.nodes.size() << " nodes, built in "
+		<< std::chrono::duration<real_t, std::milli>(build_end - build_start).count() << "ms\n";
+
+	image reference{image_width / 4, image_height / 4};
+	world.light_pick = hittable_list::LIGHT_PICK_TREE;
+	auto reference_result = render_with(ts, reference, cam, world, config.reference_samples, max_depth, config, series);
+	std::cerr << "Reference: " << config.reference_samples << " samples per pixel, " << reference_result.elapsed_ms << "ms\n";
+
+	image img{reference.width, reference.height};
+	for (auto pick: {hittable_list::LIGHT_PICK_UNIFORM, hittable_list::LIGHT_PICK_TREE})
+	{
+		world.light_pick = pick;
+		auto result = render_with(ts, img, cam, world, samples_per_pixel, max_depth, config, series);
+		auto rmse = image_rmse(img, reference);
+		auto rays = real_t(result.stat.ray_count + result.stat.bounces + result.stat.shadow_rays) / real_t(1000'000.0);
+		std::cerr << LIGHT_PICK_NAMES[pick] << ": " << result.elapsed_ms << "ms, " << samples_per_pixel << " spp, RMSE " << rmse << ", "
+			<< rays << " MRays, variance per ray " << rmse * rmse * rays << "\n";
+	}
+	world.light_pick = light_pick;
+}
+
+// renders a half size image at 4 and 8 samples per pixel and denoises it, the error against a
+// reference_samples render is matched against the samples per pixel it takes to get there
+// without the denoiser, the filter footprint is in pixels so a quarter size image would be
+// mostly edges
+void denoise_benchmark(enki::TaskScheduler& ts, int image_width, int image_height, camera& cam, hittable_list& world, int max_depth, settings config, random_series series)
+{
+	config.adaptive.enabled = false;
+	config.progressive = false;
+
+	image reference{image_width / 2, image_height / 2};
+	auto reference_result = render_with(ts, reference, cam, world, config.reference_samples, max_depth, config, series);
+	std::cerr << "Reference: " << config.reference_samples << " samples per pixel, " << reference_result.elapsed_ms << "ms\n";
+
+	struct level
+	{
+		int samples;
+		real_t rmse;
+		real_t elapsed_ms;
+	};
+	std::vector<level> levels;
+	image img{reference.width, reference.height};
+	for (int samples = 4; samples < config.reference_samples; samples *= 2)
+	{
+		auto result = render_with(ts, img, cam, world, samples, max_depth, config, series);
+		levels.push_back(level{samples, image_rmse(img, reference), result.elapsed_ms});
+		std::cerr << samples << " spp: RMSE " << levels.back().rmse << " (" << result.elapsed_ms << "ms)\n";
+	}
+
+	atrous_denoiser denoiser{&ts};
+	denoiser.iterations = config.denoise_iterations;
+	img.enable_aovs();
+	for (int samples: {4, 8})
+	{
+		auto result = render_with(ts, img, cam, world, samples, max_depth, config, series);
+		auto denoise_ms = denoiser.denoise(img);
+		auto rmse = image_rmse(img, reference);
+		std::cerr << samples << " spp + denoise: RMSE " << rmse << " (" << result.elapsed_ms << "ms render + " << denoise_ms << "ms denoise), ";
+
+		auto match = levels.begin();
+		while (match != levels.end() && match->rmse > rmse)
+			++match;
+		if (match == levels.end())
+			std::cerr << "better than " << levels.back().samples << " spp\n";
+		else
+			std::cerr << "as good as " << match->samples << " spp (" << match->elapsed_ms << "ms)\n";
+	}
+}
+
+// closest hit of a ray as --compare-accel checks it against the linear list
+struct checked_hit
+{
+	bool hit;
+	hit_record rec;
+};
+
+// the camera ray through the center of every pixel and a diffuse bounce off each of its hits,
+// so that the rays starting inside the scene are checked too
+std::vector<ray> accel_check_rays(const camera& cam, const hittable_list& world, int image_width, int image_height, random_series series)
+{
+	std::vector<ray> rays;
+	for (int j = 0; j < image_height; ++j)
+	{
+		for (int i = 0; i < image_width; ++i)
+		{
+			auto r = cam.get_ray(&series, (i + real_t(0.5)) / image_width, (j + real_t(0.5)) / image_height);
+			rays.push_back(r);
+			hit_record rec;
+			if (world.closest_hit(r, 0.001, infinity, rec))
+				rays.push_back(ray{rec.p, rec.normal + random_unit_vector(&series)});
+		}
+	}
+	return rays;
+}
+
+std::vector<checked_hit> trace_checked_hits(const hittable_list& world, const std::vector<ray>& rays)
+{
+	std::vector<checked_hit> hits(rays.size());
+	for (size_t i = 0; i < rays.size(); ++i)
+		hits[i].hit = world.closest_hit(rays[i], 0.001, infinity, hits[i].rec);
+	return hits;
+}
+
+// hits that differ from the reference in whether there's one, its t, material or normal
+size_t count_hit_mismatches(const std::vector<checked_hit>& reference, const std::vector<checked_hit>& hits)
+{
+	size_t mismatches = 0;
+	for (size_t i = 0; i < hits.size(); ++i)
+	{
+		const auto& a = reference[i];
+		const auto& b = hits[i];
+		if (a.hit != b.hit)
+			++mismatches;
+		else if (a.hit && (fabs(a.rec.t - b.rec.t) > real_t(1e-4) * max(real_t(1), a.rec.t)
+			|| a.rec.mat_index != b.rec.mat_index || (a.rec.normal - b.rec.normal).length() > real_t(1e-3)))
+			++mismatches;
+	}
+	return mismatches;
+}
+
+// renders a quarter size image with adaptive sampling and uniformly at 1 to 2 max_samples
+// samples per pixel, the errors against a reference_samples render give the uniform samples
+// per pixel that match the error of the adaptive render and the rays that saves
+void adaptive_benchmark(enki::TaskScheduler& ts, int image_width, int image_height, camera& cam, hittable_list& world, int max_depth, settings config, random_series series)
+{
+	config.progressive = false;
+	auto adaptive = config.adaptive;
+	adaptive.enabled = true;
+	config.adaptive.enabled = false;
+
+	image reference{image_width / 4, image_height / 4};
+	auto reference_result = render_with(ts, reference, cam, world, config.reference_samples, max_depth, config, series);
+	std::cerr << "Reference: " << config.reference_samples << " samples per pixel, " << reference_result.elapsed_ms << "ms\n";
+
+	struct level
+	{
+		int samples;
+		real_t rmse;
+		real_t mrays;
+	};
+	std::vector<level> levels;
+	image img{reference.width, reference.height};
+	for (int samples = 1; samples <= 2 * adaptive.max_samples && samples < config.reference_samples; samples *= 2)
+	{
+		auto result = render_with(ts, img, cam, world, samples, max_depth, config, series);
+		auto mrays = real_t(result.stat.ray_count + result.stat.bounces) / real_t(1000'000.0);
+		levels.push_back(level{samples, image_rmse(img, reference), mrays});
+		std::cerr << samples << " spp: RMSE " << levels.back().rmse << ", " << mrays << " MRays (" << result.elapsed_ms << "ms)\n";
+	}
+
+	config.adaptive = adaptive;
+	auto result = render_with(ts, img, cam, world, adaptive.max_samples, max_depth, config, series);
+	if (result.sample_counts.empty())
+	{
+		std::cerr << "the " << INTEGRATOR_NAMES[config.integrator] << " integrator doesn't sample adaptively\n";
+		return;
+	}
+	size_t samples = 0;
+	for (auto count: result.sample_counts)
+		samples += count;
+	auto rmse = image_rmse(img, reference);
+	auto mrays = real_t(result.stat.ray_count + result.stat.bounces) / real_t(1000'000.0);
+	std::cerr << "Adaptive: " << real_t(samples) / real_t(result.sample_counts.size()) << " spp, RMSE " << rmse << ", "
+		<< mrays << " MRays (" << result.elapsed_ms << "ms)\n";
+
+	// monte carlo error goes down as 1 / sqrt(spp), the uniform level with the error nearest
+	// to the adaptive one is scaled by the square of their ratio to land on it
+	auto nearest = levels.front();
+	for (const auto& l: levels)
+		if (fabs(log(l.rmse / rmse)) < fabs(log(nearest.rmse / rmse)))
+			nearest = l;
+	auto ratio = nearest.rmse / rmse;
+	auto uniform_samples = real_t(nearest.samples) * ratio * ratio;
+	auto uniform_mrays = nearest.mrays * ratio * ratio;
+	std::cerr << "Uniform at equal noise: " << uniform_samples << " spp, " << uniform_mrays << " MRays, rays saved: "
+		<< uniform_mrays - mrays << " MRays (" << (1 - mrays / uniform_mrays) * 100 << "%)\n";
+}
+
+// the aovs as gamma corrected images, the normals mapped from [-1, 1] and the depth as the
+// nearest hit over it so that the misses mixed into the silhouettes don't squash the range
+void write_aovs(const image& img)
+{
+	image albedo{img.width, img.height}, normal{img.width, img.height}, depth{img.width, img.height};
+	real_t near_depth = infinity;
+	for (auto d: img.depth)
+		near_depth = fmin(near_depth, d);
+
+	for (size_t i = 0; i < img.pixels.size(); ++i)
+	{
+		albedo.pixels[i] = sqrt(img.albedo[i]);
+		normal.pixels[i] = img.normal[i] * real_t(0.5) + color{0.5, 0.5, 0.5};
+		auto t = near_depth / max(img.depth[i], real_t(1e-6));
+		depth.pixels[i] = color{t, t, t};
+	}
+
+	image* aovs[] = {&albedo, &normal, &depth};
+	const char* paths[] = {"albedo.ppm", "normal.ppm", "depth.ppm"};
+	for (int k = 0; k < 3; ++k)
+	{
+		std::ofstream out{paths[k]};
+		aovs[k]->write(out);
+	}
+}
+
+// writes the image next to path and renames it into place so that a reader never sees a
+// half written snapshot
+bool write_snapshot(image& img, const char* path)
+{
+	std::string tmp_path = std::string{path} + ".tmp";
+	{
+		std::ofstream out{tmp_path};
+		if (out.is_open() == false)
+			return false;
+		img.write(out);
+	}
+#ifdef _WIN32
+	std::remove(path);
+#endif
+	return std::rename(tmp_path.c_str(), path) == 0;
+}
+
+struct progressive_result
+{
+	int passes;
+	int snapshots;
+	real_t first_snapshot_ms;
+};
+
+// renders passes of config.pass_samples samples per pixel into the image accumulation until
+// target_samples are in or the next pass, taking as long as the last one, would go over the
+// time budget, the image is resolved after every pass so it's always the best one so far
+render_result render_progressive(enki::TaskScheduler& ts, image& img, camera& cam, hittable_list& world, int target_samples, int max_depth, const settings& config, random_series series, wavefront_stats* stage_stats, progressive_result& progress)
+{
+	render_result result{};
+	progress = progressive_result{};
+	img.clear_accumulation();
+
+	auto start = std::chrono::high_resolution_clock::now();
+	real_t last_snapshot_ms = 0;
+	while (img.accumulated_samples < target_samples)
+	{
+		auto pass_samples = std::min(config.pass_samples, target_samples - img.accumulated_samples);
+		wavefront_stats pass_stage_stats{};
+		auto pass = render_with(ts, img, cam, world, pass_samples, max_depth, config, random_series{xor_shift_32_rand(&series)}, &pass_stage_stats, true);
+		img.accumulated_samples += pass_samples;
+		img.resolve();
+		++progress.passes;
+
+		result.stat.ray_count += pass.stat.ray_count;
+		result.stat.bounces += pass.stat.bounces;
+		result.stat.roulette_terminations += pass.stat.roulette_terminations;
+		result.stat.shadow_rays += pass.stat.shadow_rays;
+		if (stage_stats)
+			stage_stats->add_stages(pass_stage_stats);
+
+		auto now_ms = std::chrono::duration<real_t, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+		if (progress.snapshots == 0 || now_ms - last_snapshot_ms >= config.snapshot_interval_ms)
+		{
+			if (write_snapshot(img, config.snapshot_path) == false)
+				std::cerr << "failed to write snapshot '" << config.snapshot_path << "'\n";
+			now_ms = std::chrono::duration<real_t, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+			if (progress.snapshots == 0)
+				progress.first_snapshot_ms = now_ms;
+			last_snapshot_ms = now_ms;
+			++progress.snapshots;
+		}
+
+		if (config.time_budget_ms > 0 && now_ms + pass.elapsed_ms > config.time_budget_ms)
+			break;
+	}
+	result.elapsed_ms = std::chrono::duration<real_t, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+	return result;
+}
+
+int main(int argc, char** argv)
+{
+	auto config = parse_settings(argc, argv);
+	if (config.rng_benchmark)
+	{
+		rng_benchmark();
+		return 0;
+	}
+
+	if (config.sampling_benchmark)
+	{
+		sampling_benchmark();
+		return 0;
+	}
+
+	enki::TaskScheduler ts;
+	ts.Initialize();
+
+	// Image
+	const auto aspect_ratio = 16.0 / 9.0;
+	const int image_width = 640;
+	const int image_height = static_cast<int>(image_width / aspect_ratio);
+	const int samples_per_pixel = 10;
+	const int max_depth = 50;
+
+	// World
+	random_series global_random_series{42};
+	hittable_list world;
+	if (strcmp(config.scene, "aras") == 0)
+		world = aras_scene(&global_random_series);
+	else if (strcmp(config.scene, "field") == 0)
+		world = field_scene(&global_random_series, config.sphere_count, config.ground);
+	else if (strcmp(config.scene, "instanced") == 0)
+		world = instanced_scene(&global_random_series, config.instance_count, config.ground);
+	else if (strcmp(config.scene, "lamps") == 0)
+		world = lamps_scene(&global_random_series, config.lamp_count, config.ground);
+	else
+		world = random_scene(&global_random_series, config.ground);
+	world.accel = config.accel;
+	world.light_pick = config.light_pick;
+
+	auto build_start = std::chrono::high_resolution_clock::now();
+	bool cache_hit = false;
+	if (config.cache_dir[0] != '\0')
+		cache_hit = world.prepare_cached(&ts, config.builder, config.cache_dir);
+	else
+		world.prepare_soa(&ts, config.builder);
+	auto build_end = std::chrono::high_resolution_clock::now();
+	auto build_ms = std::chrono::duration<real_t, std::milli>(build_end - build_start).count();
+
+	// Camera
+	point3 lookfrom(13, 2, 3);
+	point3 lookat(0, 0, 0);
+	vec3 vup(0, 1, 0);
+	auto dist_to_focus = 10;
+	auto aperture = 0.1;
+	camera cam(lookfrom, lookat, vup, 20, aspect_ratio, aperture, dist_to_focus);
+	// camera cam(point3(0, 2, 3), point3(0, 0, 0), vec3(0, 1, 0), 60, aspect_ratio, aperture, 3);
+
+	image img{image_width, image_height};
+
+	if (config.compare_accel)
+	{
+		// every accelerator has to find the same hits as the linear list, not just be fast
+		world.use_accel(&ts, hittable_list::ACCEL_LINEAR);
+		auto check_rays = accel_check_rays(cam, world, image_width, image_height, global_random_series);
+		auto linear_hits = trace_checked_hits(world, check_rays);
+
+		real_t linear_mrays = 0;
+		for (auto accel: {hittable_list::ACCEL_LINEAR, hittable_list::ACCEL_BVH, hittable_list::ACCEL_BVH_WIDE, hittable_list::ACCEL_BVH_QUANTIZED, hittable_list::ACCEL_GRID})
+		{
+			world.use_accel(&ts, accel);
+			auto result = render_with(ts, img, cam, world, samples_per_pixel, max_depth, config, global_random_series);
+			if (accel == hittable_list::ACCEL_LINEAR)
+				linear_mrays = result.mrays_per_second();
+			auto mismatches = count_hit_mismatches(linear_hits, trace_checked_hits(world, check_rays));
+			std::cerr << ACCEL_NAMES[accel] << ": " << result.elapsed_ms << "ms, "
+				<< result.mrays_per_second() << " MRays/Second, "
+				<< result.mrays_per_second() / linear_mrays << "x linear, "
+				<< real_t(world.accel_memory_size(accel)) / real_t(1024) << " KB of nodes, "
+				<< mismatches << " of " << check_rays.size() << " hits differ from linear\n";
+		}
+		world.use_accel(&ts, config.accel);
+	}
+
+	if (config.sampler_benchmark)
+	{
+		sampler_benchmark(ts, image_width, image_height, cam, world, max_depth, config, global_random_series);
+		return 0;
+	}
+
+	if (config.nee_benchmark)
+	{
+		nee_benchmark(ts, image_width, image_height, cam, world, max_depth, config, global_random_series);
+		return 0;
+	}
+
+	if (config.light_benchmark)
+	{
+		light_benchmark(ts, image_width, image_height, cam, world, samples_per_pixel, max_depth, config, global_random_series);
+		return 0;
+	}
+
+	if (config.adaptive_benchmark)
+	{
+		adaptive_benchmark(ts, image_width, image_height, cam, world, max_depth, config, global_random_series);
+		return 0;
+	}
+
+	if (config.denoise_benchmark)
+	{
+		denoise_benchmark(ts, image_width, image_height, cam, world, max_depth, config, global_random_series);
+		return 0;
+	}
+
+	if (config.compare_integrator)
+	{
+		real_t recursive_mrays = 0;
+		auto integrator_config = config;
+		for (auto integrator: {INTEGRATOR_RECURSIVE, INTEGRATOR_ITERATIVE, INTEGRATOR_WAVEFRONT, INTEGRATOR_NEE})
+		{
+			integrator_config.integrator = integrator;
+			auto result = render_with(ts, img, cam, world, samples_per_pixel, max_depth, integrator_config, global_random_series);
+			if (integrator == INTEGRATOR_RECURSIVE)
+				recursive_mrays = result.mrays_per_second();
+			std::cerr << INTEGRATOR_NAMES[integrator] << ": " << result.elapsed_ms << "ms, "
+				<< result.mrays_per_second() << " MRays/Second, "
+				<< result.mrays_per_second() / recursive_mrays << "x recursive, "
+				<< result.average_path_length() << " average path length\n";
+		}
+	}
+
+	if (config.reorder_benchmark)
+	{
+		// every bounce is traced once in queue order and once sorted, the camera rays included
+		wavefront_integrator integrator{&ts, &img, &cam, &world, samples_per_pixel, max_depth};
+		auto unsorted = integrator.render(global_random_series);
+		integrator.reorder_batch = config.reorder_batch > 0 ? uint32_t(config.reorder_batch) : 4096;
+		integrator.reorder_min_depth = 0;
+		auto sorted = integrator.render(global_random_series);
+
+		std::cerr << "Reorder batch: " << integrator.reorder_batch << "\n";
+		int depth_count = 0;
+		while (depth_count < max_depth && unsorted.depth_rays[depth_count] > 0)
+			++depth_count;
+		for (int depth = 0; depth < depth_count; ++depth)
+		{
+			std::cerr << "Bounce " << depth << ": " << unsorted.depth_rays[depth] << " rays, "
+				<< unsorted.depth_extend_ms[depth] << "ms unsorted, "
+				<< sorted.depth_sort_ms[depth] << "ms sort + " << sorted.depth_extend_ms[depth] << "ms extend sorted\n";
+		}
+
+		// the bounce to start sorting from is the one that saves the most over the bounces
+		// that follow it
+		int best_depth = depth_count;
+		real_t saved_ms = 0, best_saved_ms = 0;
+		for (int depth = depth_count - 1; depth >= 0; --depth)
+		{
+			saved_ms += unsorted.depth_extend_ms[depth] - sorted.depth_sort_ms[depth] - sorted.depth_extend_ms[depth];
+			if (saved_ms > best_saved_ms)
+			{
+				best_saved_ms = saved_ms;
+				best_depth = depth;
+			}
+		}
+		if (best_depth == depth_count)
+			std::cerr << "Reordering doesn't pay off\n";
+		else
+			std::cerr << "Reordering pays off from bounce " << best_depth << ", saves " << best_saved_ms << "ms\n";
+	}
+
+	if (config.frames > 0)
+	{
+		// every sphere except the huge ones drifts along its own direction, the topology stays
+		random_series motion_series{7};
+		std::vector<point3> start_centers;
+		std::vector<vec3> velocities;
+		for (const auto& s: world.spheres)
+		{
+			start_centers.push_back(s.center);
+			if (s.radius < 10)
+				velocities.push_back(vec3{random_double(&motion_series, -1, 1), 0, random_double(&motion_series, -1, 1)} * 0.05);
+			else
+				velocities.push_back(vec3{});
+		}
+
+		real_t refit_ms = 0, rebuild_ms = 0, accel_ms = 0;
+		int refit_count = 0, rebuild_count = 0;
+		for (int frame = 0; frame < config.frames; ++frame)
+		{
+			for (size_t i = 0; i < world.spheres.size(); ++i)
+				world.spheres[i].center = start_centers[i] + real_t(frame) * velocities[i];
+
+			auto update_start = std::chrono::high_resolution_clock::now();
+			auto rebuilt = world.update(&ts, config.builder, config.rebuild_threshold);
+			auto update_end = std::chrono::high_resolution_clock::now();
+			auto update_ms = std::chrono::duration<real_t, std::milli>(update_end - update_start).count();
+			if (rebuilt) { rebuild_ms += update_ms; ++rebuild_count; }
+			else { refit_ms += update_ms; ++refit_count; }
+
+			// the accelerators that can't be refitted (the grid) are built again after a refit
+			auto accel_start = std::chrono::high_resolution_clock::now();
+			world.build_accel(&ts);
+			auto accel_end = std::chrono::high_resolution_clock::now();
+			auto frame_accel_ms = std::chrono::duration<real_t, std::milli>(accel_end - accel_start).count();
+			accel_ms += frame_accel_ms;
+
+			auto result = render_with(ts, img, cam, world, samples_per_pixel, max_depth, config, global_random_series);
+
+			char filename[64];
+			snprintf(filename, sizeof(filename), "frame_%03d.ppm", frame);
+			std::ofstream out{filename};
+			img.write(out);
+
+			std::cerr << "Frame " << frame << ": " << (rebuilt ? "rebuild " : "refit ") << update_ms << "ms, "
+				<< "accel build: " << frame_accel_ms << "ms, "
+				<< "SAH cost: " << bvh_sah_cost(&ts, world.tree) / world.build_sah_cost << "x built, "
+				<< "render: " << result.elapsed_ms << "ms, " << result.mrays_per_second() << " MRays/Second\n";
+		}
+
+		std::cerr << "Refit: " << refit_count << " frames, " << (refit_count ? refit_ms / refit_count : 0) << "ms/frame\n";
+		std::cerr << "Rebuild: " << rebuild_count << " frames, " << (rebuild_count ? rebuild_ms / rebuild_count : 0) << "ms/frame\n";
+		std::cerr << "Accel build after update: " << accel_ms / config.frames << "ms/frame\n";
+		return 0;
+	}
+
+	if (config.denoise || config.write_aovs)
+		img.enable_aovs();
+
+	wavefront_stats stage_stats{};
+	progressive_result progress{};
+	render_result result{};
+	if (config.progressive)
+	{
+		auto target_samples = config.target_samples > 0 ? config.target_samples : samples_per_pixel;
+		result = render_progressive(ts, img, cam, world, target_samples, max_depth, config, global_random_series, &stage_stats, progress);
+	}
+	else
+	{
+		result = render_with(ts, img, cam, world, samples_per_pixel, max_depth, config, global_random_series, &stage_stats);
+	}
+	auto& global_stat = result.stat;
+
+	// a post pass on the finished image, timed on its own
+	real_t denoise_ms = 0;
+	if (config.denoise)
+	{
+		atrous_denoiser denoiser{&ts};
+		denoiser.iterations = config.denoise_iterations;
+		denoise_ms = denoiser.denoise(img);
+	}
+	if (config.write_aovs)
+		write_aovs(img);
+
+	img.write(std::cout);
+	std::cerr << "\nDone.\n";
+
+	std::cerr << "Spheres: " << world.spheres.size() << ", Accelerator: " << ACCEL_NAMES[world.accel] << ", BVH width: " << hittable_list::wide_width() << "\n";
+	if (world.accel == hittable_list::ACCEL_GRID)
+		std::cerr << "Grid: " << world.grid.res[0] << "x" << world.grid.res[1] << "x" << world.grid.res[2] << ", " << world.grid.soa_index.size() << " entries\n";
+	std::cerr << "Integrator: " << INTEGRATOR_NAMES[config.integrator] << ", Sampler: " << SAMPLER_NAMES[config.sampler_kind] << ", Packet size: " << config.packet_size << "\n";
+	std::cerr << "Unbounded: " << world.view().sphere_count - world.view().bounded_count << " huge spheres, " << world.planes.size() << " planes\n";
+	std::cerr << "Instances: " << world.instances.size() << ", Scene memory: " << real_t(world.memory_size()) / real_t(1024 * 1024) << " MB\n";
+	if (cache_hit)
+		std::cerr << "Load time: " << build_ms << "ms, Accel cache: " << config.cache_dir << "\n";
+	else
+		std::cerr << "Build time: " << build_ms << "ms, Builder: " << BUILDER_NAMES[config.builder] << ", SAH cost: " << world.build_sah_cost << "\n";
+	std::cerr << "Elapsed time: " << result.elapsed_ms << "ms\n";
+	if (config.denoise)
+		std::cerr << "Denoise: " << denoise_ms << "ms, " << config.denoise_iterations << " iterations\n";
+	if (config.progressive)
+		std::cerr << "Progressive: " << progress.passes << " passes, " << img.accumulated_samples << " samples per pixel, "
+			<< progress.snapshots << " snapshots, first after " << progress.first_snapshot_ms << "ms\n";
+	std::cerr << "Total Rays: " << real_t(global_stat.ray_count) / real_t(1000'000.0) << " MRays, Bounces: " << real_t(global_stat.bounces) / real_t(1000'000.0) << " MRays\n";
+	std::cerr << "Ray Per Sec: " << result.mrays_per_second() << " MRays/Second\n";
+	std::cerr << "Average path length: " << result.average_path_length() << ", Roulette terminations: " << global_stat.roulette_terminations << "\n";
+	if (config.integrator == INTEGRATOR_NEE)
+		std::cerr << "Lights: " << world.lights.size() << ", Light pick: " << LIGHT_PICK_NAMES[world.light_pick] << ", Shadow rays: " << real_t(global_stat.shadow_rays) / real_t(1000'000.0) << " MRays\n";
+	if (result.sample_counts.empty() == false)
+	{
+		// blue took the fewest samples, red hit the cap
+		image heatmap{img.width, img.height};
+		size_t samples = 0;
+		for (size_t i = 0; i < result.sample_counts.size(); ++i)
+		{
+			auto t = real_t(result.sample_counts[i]) / real_t(config.adaptive.max_samples);
+			heatmap.pixels[i] = color{t, 1 - fabs(2 * t - 1), 1 - t};
+			samples += result.sample_counts[i];
+		}
+		std::ofstream out{config.heatmap_path};
+		heatmap.write(out);
+
+		// the rays saved against giving every pixel the cap, that's not the same noise since the
+		// pixels that stopped early are noisier, --adaptive-benchmark measures it at equal noise
+		auto uniform_samples = result.sample_counts.size() * size_t(config.adaptive.max_samples);
+		auto saved_samples = uniform_samples - samples;
+		std::cerr << "Adaptive samples: " << real_t(samples) / real_t(result.sample_counts.size()) << " per pixel, "
+			<< real_t(samples) * 100 / real_t(uniform_samples) << "% of " << config.adaptive.max_samples << " uniform, heatmap: " << config.heatmap_path << "\n";
+		std::cerr << "Rays saved against " << config.adaptive.max_samples << " spp uniform: " << real_t(saved_samples) * result.average_path_length() / real_t(1000'000.0) << " MRays\n";
+	}
+	if (config.integrator == INTEGRATOR_WAVEFRONT)
+	{
+		for (int stage = 0; stage < WAVEFRONT_STAGE_COUNT; ++stage)
+			std::cerr << "Wavefront " << WAVEFRONT_STAGE_NAMES[stage] << ": " << stage_stats.stage_ms[stage] << "ms, "
+				<< stage_stats.stage_mrays_per_second(stage) << " MRays/Second\n";
+		std::cerr << "Shade kind switches: " << stage_stats.shade_kind_switches << " in hit order, "
+			<< stage_stats.shade_sorted_kind_switches << " bucketed by kind\n";
+	}
+
+	return 0;
+}
@@ -2,6 +2,7 @@
 
 #include "rtweekend.h"
 #include "hittable.h"
+#include "sampler.h"
 
 #include <assert.h>
 
@@ -12,61 +13,82 @@ struct material
 		KIND_LAMBERTIAN,
 		KIND_METAL,
 		KIND_DIELECTRIC,
+		// light source, emits and doesn't scatter
+		KIND_EMISSIVE,
 	};
 
 	KIND kind;
 	color albedo;
 	real_t fuzz;
 	real_t ir;
+	color emit;
 
-	bool scatter(random_series* series, const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const
+	color emitted() const
+	{
+		return kind == KIND_EMISSIVE ? emit : color{};
+	}
+
+	bool scatter(sampler* smp, const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const
 	{
 		switch (kind)
 		{
 		case KIND_LAMBERTIAN:
-		{
-			auto scatter_direction = rec.normal + random_unit_vector(series);
-
-			if (scatter_direction.near_zero())
-				scatter_direction = rec.normal;
-
-			scattered = ray(rec.p, scatter_direction);
-			attenuation = albedo;
-			return true;
-		}
+			return scatter_lambertian(smp, r_in, rec, attenuation, scattered);
 		case KIND_METAL:
-		{
-			vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
-			scattered = ray(rec.p, reflected + fuzz * random_in_unit_sphere(series));
-			attenuation = albedo;
-			return (dot(scattered.direction(), rec.normal) > 0);
-		}
+			return scatter_metal(smp, r_in, rec, attenuation, scattered);
 		case KIND_DIELECTRIC:
-		{
-			attenuation = color{1, 1, 1};
-			real_t refraction_ratio = rec.front_face ? (1.0/ir) : ir;
-
-			vec3 unit_direction = unit_vector(r_in.direction());
-			auto cos_theta = fmin(dot(-unit_direction, rec.normal), 1.0);
-			auto sin_theta = sqrt(1.0 - cos_theta*cos_theta);
-
-			bool cannot_refract = refraction_ratio * sin_theta > 1.0;
-			vec3 direction{};
-
-			if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double(series))
-				direction = reflect(unit_direction, rec.normal);
-			else
-				direction = refract(unit_direction, rec.normal, refraction_ratio);
-
-			scattered = ray(rec.p, direction);
-			return true;
-		}
+			return scatter_dielectric(smp, r_in, rec, attenuation, scattered);
+		case KIND_EMISSIVE:
+			return false;
 		default:
 			assert(false && "unreachable");
 			return false;
 		}
 	}
 
+	// per kind scatter, for callers that already know the kind of a whole batch of hits, they
+	// all take the incoming ray even though a lambertian bounce doesn't depend on it
+	bool scatter_lambertian(sampler* smp, const ray&, const hit_record& rec, color& attenuation, ray& scattered) const
+	{
+		auto scatter_direction = rec.normal + random_unit_vector(smp);
+
+		if (scatter_direction.near_zero())
+			scatter_direction = rec.normal;
+
+		scattered = ray(rec.p, scatter_direction);
+		attenuation = albedo;
+		return true;
+	}
+
+	bool scatter_metal(sampler* smp, const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const
+	{
+		vec3 reflected = reflect(unit_vector(r_in.direction()), rec.normal);
+		scattered = ray(rec.p, reflected + fuzz * random_in_unit_sphere(smp));
+		attenuation = albedo;
+		return (dot(scattered.direction(), rec.normal) > 0);
+	}
+
+	bool scatter_dielectric(sampler* smp, const ray& r_in, const hit_record& rec, color& attenuation, ray& scattered) const
+	{
+		attenuation = color{1, 1, 1};
+		real_t refraction_ratio = rec.front_face ? (1.0/ir) : ir;
+
+		vec3 unit_direction = unit_vector(r_in.direction());
+		auto cos_theta = fmin(dot(-unit_direction, rec.normal), 1.0);
+		auto sin_theta = sqrt(1.0 - cos_theta*cos_theta);
+
+		bool cannot_refract = refraction_ratio * sin_theta > 1.0;
+		vec3 direction{};
+
+		if (cannot_refract || reflectance(cos_theta, refraction_ratio) > random_double(smp))
+			direction = reflect(unit_direction, rec.normal);
+		else
+			direction = refract(unit_direction, rec.normal, refraction_ratio);
+
+		scattered = ray(rec.p, direction);
+		return true;
+	}
+
 private:
 	static real_t reflectance(real_t cosine, real_t ref_idx)
 	{
@@ -103,3 +125,12 @@ dielectric(real_t ir)
 	self.ir = ir;
 	return self;
 }
+
+inline static material
+emissive(const color& emit)
+{
+	material self{};
+	self.kind = material::KIND_EMISSIVE;
+	self.emit = emit;
+	return self;
+}
@@ -0,0 +1,48 @@
+#pragma once
+
+#include "aabb.h"
+
+#include <stdint.h>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+inline static int
+_clz32(uint32_t x)
+{
+	if (x == 0)
+		return 32;
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanReverse(&index, x);
+	return 31 - int(index);
+#else
+	return __builtin_clz(x);
+#endif
+}
+
+// spreads the lower 10 bits of v so that there are 2 zero bits between each of them
+inline static uint32_t
+_morton_expand_bits(uint32_t v)
+{
+	v = (v * 0x00010001u) & 0xFF0000FFu;
+	v = (v * 0x00000101u) & 0x0F00F00Fu;
+	v = (v * 0x00000011u) & 0xC30C30C3u;
+	v = (v * 0x00000005u) & 0x49249249u;
+	return v;
+}
+
+// 30 bit morton code of p quantized to a 1024^3 grid over bounds
+inline static uint32_t
+morton_encode(const aabb& bounds, const point3& p)
+{
+	auto extent = bounds.extent();
+	uint32_t q[3];
+	for (int axis = 0; axis < 3; ++axis)
+	{
+		auto n = extent[axis] > 0 ? (p[axis] - bounds.min[axis]) / extent[axis] : real_t(0);
+		q[axis] = uint32_t(clamp(n * 1024, 0, 1023));
+	}
+	return (_morton_expand_bits(q[0]) << 2) | (_morton_expand_bits(q[1]) << 1) | _morton_expand_bits(q[2]);
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <TaskScheduler.h>
+
+#include <stdint.h>
+#include <type_traits>
+
+template<typename F>
+struct parallel_for_task: public enki::ITaskSet
+{
+	F* func;
+
+	void ExecuteRange(enki::TaskSetPartition range, uint32_t thread_ix) override
+	{
+		(*func)(range.start, range.end, thread_ix);
+	}
+};
+
+// calls func(start, end, thread_ix) over sub ranges of [0, count) on the scheduler and waits
+// for all of them, without a scheduler the whole range runs on the calling thread
+template<typename F>
+inline static void
+parallel_for(enki::TaskScheduler* ts, uint32_t count, uint32_t min_range, F&& func)
+{
+	if (count == 0)
+		return;
+
+	if (ts == nullptr)
+	{
+		func(uint32_t(0), count, uint32_t(0));
+		return;
+	}
+
+	parallel_for_task<typename std::remove_reference<F>::type> task{};
+	task.func = &func;
+	task.m_SetSize = count;
+	task.m_MinRange = min_range;
+	ts->AddTaskSetToPipe(&task);
+	ts->WaitforTask(&task);
+}
+
+inline static uint32_t
+parallel_thread_count(enki::TaskScheduler* ts)
+{
+	return ts ? ts->GetNumTaskThreads() : 1;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "hittable.h"
+#include "vec3.h"
+
+// infinite plane through point facing normal, it has no bounds so hittable_list keeps it
+// out of the acceleration structures and tests it on every ray
+class plane
+{
+public:
+	plane() {}
+	plane(point3 p, vec3 n, int m)
+		: point(p),
+		  normal(unit_vector(n)),
+		  mat_index(m)
+	{}
+
+	bool hit(const ray& r, real_t t_min, real_t t_max, hit_record& rec) const
+	{
+		auto denom = dot(normal, r.direction());
+		if (denom == 0) return false;
+
+		auto root = dot(point - r.origin(), normal) / denom;
+		if (root < t_min || root > t_max)
+			return false;
+
+		rec.t = root;
+		rec.p = r.at(rec.t);
+		rec.set_face_normal(r, normal);
+		rec.mat_index = mat_index;
+		return true;
+	}
+
+	point3 point;
+	vec3 normal;
+	int mat_index;
+};
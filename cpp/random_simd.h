@@ -0,0 +1,157 @@
+#pragma once
+
+#include "rtweekend.h"
+
+#include <stdint.h>
+
+#if SIMD
+#include <emmintrin.h>
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// murmur3 finalizer, every input bit affects every output bit
+inline static uint32_t
+_random_mix32(uint32_t x)
+{
+	x ^= x >> 16; x *= 0x85EBCA6Bu;
+	x ^= x >> 13; x *= 0xC2B2AE35u;
+	x ^= x >> 16;
+	return x;
+}
+
+// starting state of stream `stream` of the generator seeded with `seed`, the seed and the
+// stream are mixed separately and then together so that neighboring streams (lanes, pixels)
+// start at unrelated points of the xorshift cycle instead of a few steps apart, 0 is the one
+// state xorshift never leaves so it's mapped to 1, random.isph has the same function
+inline static uint32_t
+random_seed(uint32_t seed, uint32_t stream)
+{
+	auto x = _random_mix32(_random_mix32(seed) ^ _random_mix32(stream * 0x9E3779B9u + 0x7F4A7C15u));
+	return x ? x : 1u;
+}
+
+// floats in [0, 1) from the top 24 bits of a state, 24 bits is all a float mantissa holds
+// and unlike state / UINT32_MAX it never rounds up to 1
+constexpr real_t RANDOM_FLOAT_SCALE = real_t(1.0 / 16777216.0);
+
+// 4 xorshift32 streams advanced together, lane k goes through the same states as a
+// random_series seeded with random_seed(seed, first_stream + k) would
+struct random_series_x4
+{
+#if SIMD
+	__m128i state;
+#else
+	uint32_t state[4];
+#endif
+};
+
+inline static random_series_x4
+random_series_x4_seed(uint32_t seed, uint32_t first_stream)
+{
+	uint32_t lanes[4];
+	for (uint32_t k = 0; k < 4; ++k)
+		lanes[k] = random_seed(seed, first_stream + k);
+	random_series_x4 self{};
+#if SIMD
+	self.state = _mm_loadu_si128((const __m128i*)lanes);
+#else
+	for (int k = 0; k < 4; ++k)
+		self.state[k] = lanes[k];
+#endif
+	return self;
+}
+
+// 4 floats in [0, 1), one per lane
+inline static void
+random_float_x4(random_series_x4* series, real_t out[4])
+{
+#if SIMD
+	auto x = series->state;
+	x = _mm_xor_si128(x, _mm_slli_epi32(x, 13));
+	x = _mm_xor_si128(x, _mm_srli_epi32(x, 17));
+	x = _mm_xor_si128(x, _mm_slli_epi32(x, 15));
+	series->state = x;
+	auto f = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(x, 8)), _mm_set1_ps(RANDOM_FLOAT_SCALE));
+	_mm_storeu_ps(out, f);
+#else
+	for (int k = 0; k < 4; ++k)
+	{
+		random_series lane{series->state[k]};
+		out[k] = real_t(xor_shift_32_rand(&lane) >> 8) * RANDOM_FLOAT_SCALE;
+		series->state[k] = lane.state;
+	}
+#endif
+}
+
+inline static random_series
+random_series_x4_lane(const random_series_x4& series, int k)
+{
+#if SIMD
+	uint32_t lanes[4];
+	_mm_storeu_si128((__m128i*)lanes, series.state);
+	return random_series{lanes[k]};
+#else
+	return random_series{series.state[k]};
+#endif
+}
+
+#if SIMD
+// msvc emits avx2 intrinsics anywhere, gcc and clang only in functions built for avx2 so
+// the 8 lane functions are compiled for it on their own and picked at run time
+#ifdef _MSC_VER
+#define RANDOM_AVX2
+#else
+#define RANDOM_AVX2 __attribute__((target("avx2")))
+#endif
+
+// true when the cpu and the os both support avx2, the 8 lane functions can't be called
+// otherwise
+inline static bool
+random_avx2_supported()
+{
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 1);
+	// osxsave and avx, then the os saves the ymm registers
+	if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0)
+		return false;
+	if ((_xgetbv(0) & 6) != 6)
+		return false;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1 << 5)) != 0;
+#else
+	return __builtin_cpu_supports("avx2");
+#endif
+}
+
+// 8 lane version for avx2 cpus, same streams as random_series_x4, the state is kept as plain
+// lanes so no 256 bit value crosses into code built without avx2
+struct random_series_x8
+{
+	uint32_t state[8];
+};
+
+inline static random_series_x8
+random_series_x8_seed(uint32_t seed, uint32_t first_stream)
+{
+	random_series_x8 self{};
+	for (uint32_t k = 0; k < 8; ++k)
+		self.state[k] = random_seed(seed, first_stream + k);
+	return self;
+}
+
+RANDOM_AVX2 inline static void
+random_float_x8(random_series_x8* series, real_t out[8])
+{
+	auto x = _mm256_loadu_si256((const __m256i*)series->state);
+	x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 13));
+	x = _mm256_xor_si256(x, _mm256_srli_epi32(x, 17));
+	x = _mm256_xor_si256(x, _mm256_slli_epi32(x, 15));
+	_mm256_storeu_si256((__m256i*)series->state, x);
+	auto f = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(x, 8)), _mm256_set1_ps(RANDOM_FLOAT_SCALE));
+	_mm256_storeu_ps(out, f);
+}
+#endif
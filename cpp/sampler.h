@@ -0,0 +1,195 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "random_simd.h"
+
+#include <stdint.h>
+
+#include <assert.h>
+
+inline static uint32_t
+_sampler_reverse_bits(uint32_t x)
+{
+	x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+	x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+	x = ((x >> 4) & 0x0F0F0F0Fu) | ((x & 0x0F0F0F0Fu) << 4);
+	x = ((x >> 8) & 0x00FF00FFu) | ((x & 0x00FF00FFu) << 8);
+	return (x >> 16) | (x << 16);
+}
+
+// hash that only lets a bit affect the bits above it (Laine and Karras), the constants are
+// Burley's from "Practical Hash-based Owen Scrambling"
+inline static uint32_t
+_sampler_laine_karras(uint32_t x, uint32_t seed)
+{
+	x += seed;
+	x ^= x * 0x6C50B47Cu;
+	x ^= x * 0xB82F1E52u;
+	x ^= x * 0xC7AFE638u;
+	x ^= x * 0x8D22F6E6u;
+	return x;
+}
+
+// owen scrambling, every bit is flipped depending on the bits above it in the fraction, which
+// are the bits below it in x so the hash runs on the reversed bits
+inline static uint32_t
+_sampler_owen_scramble(uint32_t x, uint32_t seed)
+{
+	return _sampler_reverse_bits(_sampler_laine_karras(_sampler_reverse_bits(x), seed));
+}
+
+// the first two sobol dimensions as 32 bit fractions, the first is the van der corput sequence
+// and the direction numbers of the second go v, v ^ (v >> 1), ...
+inline static void
+_sampler_sobol_2d(uint32_t index, uint32_t& x, uint32_t& y)
+{
+	x = _sampler_reverse_bits(index);
+	y = 0;
+	for (uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1)
+		if (index & 1)
+			y ^= v;
+}
+
+// sample `index` of dimensions 2 * pair and 2 * pair + 1 of an owen scrambled sobol sequence,
+// every pair shuffles the indices and scrambles the points with its own seeds so the pairs are
+// independent of each other while each one keeps the stratification of the 2d sobol points
+// over any power of 2 prefix of the samples (Burley)
+inline static void
+owen_sobol_2d(uint32_t index, uint32_t pair, uint32_t seed, real_t& a, real_t& b)
+{
+	auto pair_seed = random_seed(seed, pair);
+	uint32_t x, y;
+	_sampler_sobol_2d(_sampler_owen_scramble(index, pair_seed), x, y);
+	x = _sampler_owen_scramble(x, _random_mix32(pair_seed ^ 0xA511E9B3u));
+	y = _sampler_owen_scramble(y, _random_mix32(pair_seed ^ 0x63D83595u));
+	a = real_t(x >> 8) * RANDOM_FLOAT_SCALE;
+	b = real_t(y >> 8) * RANDOM_FLOAT_SCALE;
+}
+
+// every pixel scrambles the sequence with its own seed, the seed doesn't change between renders
+// so that the samples of a progressive pass pick up where the previous pass stopped
+inline static uint32_t
+sampler_pixel_seed(uint32_t pixel)
+{
+	return random_seed(0x50B01u, pixel);
+}
+
+// the dimensions a path draws are the pixel jitter (0, 1), the lens (2, 3) then 2 per draw of
+// every bounce, 1d draws take a whole pair and use its first dimension
+constexpr uint32_t SAMPLER_CAMERA_DIMENSIONS = 4;
+// dimensions past these come from a random stream of the sample, the first bounces are where
+// stratification shows in the image and a sobol draw costs a lot more than a xorshift one
+constexpr uint32_t SAMPLER_SOBOL_DIMENSIONS = 16;
+
+// where the random numbers of a path come from, KIND_RANDOM draws from a random_series and
+// KIND_SOBOL indexes an owen scrambled sobol sequence by (pixel, sample, dimension) so the
+// samples of a pixel cover every pair of dimensions evenly
+struct sampler
+{
+	enum KIND
+	{
+		KIND_RANDOM,
+		KIND_SOBOL,
+	};
+
+	KIND kind;
+	// KIND_RANDOM draws from series, KIND_SOBOL from tail past SAMPLER_SOBOL_DIMENSIONS
+	random_series* series;
+	random_series tail;
+	uint32_t seed;
+	uint32_t index;
+	uint32_t dimension;
+
+	real_t get_1d()
+	{
+		switch (kind)
+		{
+		case KIND_RANDOM:
+			return random_double(series);
+		case KIND_SOBOL:
+		{
+			if (dimension >= SAMPLER_SOBOL_DIMENSIONS)
+				return random_double(&tail);
+			real_t a, b;
+			owen_sobol_2d(index, dimension / 2, seed, a, b);
+			dimension += 2;
+			return a;
+		}
+		default:
+			assert(false && "unreachable");
+			return 0;
+		}
+	}
+
+	void get_2d(real_t& a, real_t& b)
+	{
+		switch (kind)
+		{
+		case KIND_RANDOM:
+			a = random_double(series);
+			b = random_double(series);
+			break;
+		case KIND_SOBOL:
+			if (dimension >= SAMPLER_SOBOL_DIMENSIONS)
+			{
+				a = random_double(&tail);
+				b = random_double(&tail);
+				break;
+			}
+			owen_sobol_2d(index, dimension / 2, seed, a, b);
+			dimension += 2;
+			break;
+		default:
+			assert(false && "unreachable");
+			break;
+		}
+	}
+};
+
+inline static sampler
+random_sampler(random_series* series)
+{
+	sampler self{};
+	self.kind = sampler::KIND_RANDOM;
+	self.series = series;
+	return self;
+}
+
+// sample `index` of pixel `pixel` past the camera dimensions, the camera ray of the sample is
+// made from the same pixel and index, see camera::get_rays
+inline static sampler
+sobol_sampler(uint32_t pixel, uint32_t index)
+{
+	sampler self{};
+	self.kind = sampler::KIND_SOBOL;
+	self.seed = sampler_pixel_seed(pixel);
+	self.tail = random_series{random_seed(self.seed, index)};
+	self.index = index;
+	self.dimension = SAMPLER_CAMERA_DIMENSIONS;
+	return self;
+}
+
+// sampler versions of the vec3.h helpers, they draw in the same order so a KIND_RANDOM sampler
+// gives the same directions as the random_series ones
+
+inline static real_t
+random_double(sampler* s)
+{
+	return s->get_1d();
+}
+
+inline static vec3
+random_unit_vector(sampler* s)
+{
+	real_t u1, u2;
+	s->get_2d(u1, u2);
+	return unit_vector_sample(u1, u2);
+}
+
+inline static vec3
+random_in_unit_sphere(sampler* s)
+{
+	real_t u1, u2;
+	s->get_2d(u1, u2);
+	return unit_sphere_sample(u1, u2, s->get_1d());
+}
@@ -1,16 +1,18 @@
 #pragma once
 
 #include "hittable.h"
+#include "aabb.h"
 #include "vec3.h"
 
 class sphere
 {
 public:
 	sphere() {}
-	sphere(point3 cen, real_t r, int m)
+	sphere(point3 cen, real_t r, int m, bool u = false)
 		: center(cen),
 		  radius(r),
-		  mat_index(m)
+		  mat_index(m),
+		  unbounded(u)
 	{}
 
 	bool hit(const ray& r, real_t t_min, real_t t_max, hit_record& rec) const
@@ -41,7 +43,15 @@ public:
 		return true;
 	}
 
+	aabb bounds() const
+	{
+		return aabb{center - vec3{radius}, center + vec3{radius}};
+	}
+
 	point3 center;
 	real_t radius;
 	int mat_index;
+	// kept out of the acceleration structures and tested on every ray like a plane, for the
+	// ground spheres that would stretch the box of every node above them
+	bool unbounded = false;
 };
\ No newline at end of file
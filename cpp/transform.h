@@ -0,0 +1,108 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "aabb.h"
+
+// affine 3x4 transform, the axes are the columns of the linear part
+struct transform
+{
+	vec3 x_axis{1, 0, 0};
+	vec3 y_axis{0, 1, 0};
+	vec3 z_axis{0, 0, 1};
+	vec3 translation{0, 0, 0};
+
+	point3 apply_point(const point3& p) const
+	{
+		return apply_vector(p) + translation;
+	}
+
+	vec3 apply_vector(const vec3& v) const
+	{
+		return x_axis * v.x() + y_axis * v.y() + z_axis * v.z();
+	}
+
+	// multiplies by the transpose of the linear part, applied to a world to object
+	// transform this moves object space normals to world space
+	vec3 apply_transposed(const vec3& v) const
+	{
+		return vec3{dot(x_axis, v), dot(y_axis, v), dot(z_axis, v)};
+	}
+
+	transform inverse() const
+	{
+		// the rows of the inverse are the cross products of the other two columns over the determinant
+		auto r0 = cross(y_axis, z_axis);
+		auto r1 = cross(z_axis, x_axis);
+		auto r2 = cross(x_axis, y_axis);
+		auto inv_det = 1 / dot(x_axis, r0);
+		r0 *= inv_det;
+		r1 *= inv_det;
+		r2 *= inv_det;
+
+		transform self{};
+		self.x_axis = vec3{r0.x(), r1.x(), r2.x()};
+		self.y_axis = vec3{r0.y(), r1.y(), r2.y()};
+		self.z_axis = vec3{r0.z(), r1.z(), r2.z()};
+		self.translation = -self.apply_vector(translation);
+		return self;
+	}
+};
+
+// a * b applies b first then a
+inline transform operator*(const transform& a, const transform& b)
+{
+	transform self{};
+	self.x_axis = a.apply_vector(b.x_axis);
+	self.y_axis = a.apply_vector(b.y_axis);
+	self.z_axis = a.apply_vector(b.z_axis);
+	self.translation = a.apply_point(b.translation);
+	return self;
+}
+
+inline static transform
+transform_translate(const vec3& offset)
+{
+	transform self{};
+	self.translation = offset;
+	return self;
+}
+
+inline static transform
+transform_scale(real_t s)
+{
+	transform self{};
+	self.x_axis = vec3{s, 0, 0};
+	self.y_axis = vec3{0, s, 0};
+	self.z_axis = vec3{0, 0, s};
+	return self;
+}
+
+inline static transform
+transform_rotate_y(real_t degrees)
+{
+	auto radians = degrees_to_radians(degrees);
+	auto c = real_t(cos(radians));
+	auto s = real_t(sin(radians));
+	transform self{};
+	self.x_axis = vec3{c, 0, -s};
+	self.z_axis = vec3{s, 0, c};
+	return self;
+}
+
+inline static aabb
+transform_bounds(const transform& t, const aabb& b)
+{
+	aabb self{};
+	if (b.empty())
+		return self;
+	for (int i = 0; i < 8; ++i)
+	{
+		point3 corner{
+			(i & 1) ? b.max.x() : b.min.x(),
+			(i & 2) ? b.max.y() : b.min.y(),
+			(i & 4) ? b.max.z() : b.min.z()
+		};
+		self.expand(t.apply_point(corner));
+	}
+	return self;
+}
@@ -2,10 +2,18 @@
 
 #include <cmath>
 #include <iostream>
+#include <stdint.h>
+#include <string.h>
 
 using std::sqrt;
 
 #define SIMD 1
+// random directions, points and disk samples from branchless polynomial mappings instead of
+// cos, sin and pow, they're a little less accurate so the libm versions stay the default and
+// -DFAST_SAMPLING=1 switches to them, --sampling-benchmark measures both
+#ifndef FAST_SAMPLING
+#define FAST_SAMPLING 0
+#endif
 
 #if SIMD
 
@@ -41,6 +49,13 @@ public:
 	real_t y() const { return _mm_cvtss_f32(_mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 1, 1, 1))); }
 	real_t z() const { return _mm_cvtss_f32(_mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 2, 2, 2))); }
 
+	real_t operator[](int i) const
+	{
+		alignas(16) real_t e[4];
+		_mm_store_ps(e, m);
+		return e[i];
+	}
+
 	vec3 operator-() const
 	{
 		return vec3{_mm_xor_ps(m, _mm_set1_ps(-0.0f))};
@@ -177,6 +192,16 @@ inline vec3 sqrt(vec3 v)
 	return vec3{_mm_sqrt_ps(v.m)};
 }
 
+inline vec3 vmin(const vec3& u, const vec3& v)
+{
+	return vec3{_mm_min_ps(u.m, v.m)};
+}
+
+inline vec3 vmax(const vec3& u, const vec3& v)
+{
+	return vec3{_mm_max_ps(u.m, v.m)};
+}
+
 #else
 class vec3
 {
@@ -314,6 +339,16 @@ inline vec3 sqrt(vec3 v)
 	return vec3{sqrt(v.e[0]), sqrt(v.e[1]), sqrt(v.e[2])};
 }
 
+inline vec3 vmin(const vec3& u, const vec3& v)
+{
+	return vec3{fmin(u.e[0], v.e[0]), fmin(u.e[1], v.e[1]), fmin(u.e[2], v.e[2])};
+}
+
+inline vec3 vmax(const vec3& u, const vec3& v)
+{
+	return vec3{fmax(u.e[0], v.e[0]), fmax(u.e[1], v.e[1]), fmax(u.e[2], v.e[2])};
+}
+
 #endif
 
 real_t max(real_t a, real_t b)
@@ -323,26 +358,137 @@ real_t max(real_t a, real_t b)
 	return b;
 }
 
-vec3 random_in_unit_sphere(random_series* series)
+// sin and cos of 2 pi t for t > -1/2, the turn is folded into [-1/4, 1/4] with abs and copysign
+// instead of branches then the odd taylor series up to x^11 is within 6e-8 of sin there, the
+// rounding of the float steps brings the error to about 4e-7
+inline void fast_sincos_turns(real_t t, real_t& s, real_t& c)
+{
+	auto sin_folded = [](real_t t) {
+		auto r = t - real_t(int(t + real_t(0.5)));
+		// sin(pi - x) = sin(x), min(a, 1/2 - a) without a compare so loops of it vectorize
+		auto folded = real_t(0.25) - std::fabs(std::fabs(r) - real_t(0.25));
+		auto x = (2 * pi) * std::copysign(folded, r);
+		auto x2 = x * x;
+		return x * (1 + x2 * (real_t(-1.0 / 6.0) + x2 * (real_t(1.0 / 120.0) + x2 * (real_t(-1.0 / 5040.0)
+			+ x2 * (real_t(1.0 / 362880.0) + x2 * real_t(-1.0 / 39916800.0))))));
+	};
+	s = sin_folded(t);
+	c = sin_folded(t + real_t(0.25));
+}
+
+static_assert(sizeof(real_t) == sizeof(uint32_t), "fast_cbrt starts from the bits of a float");
+
+// cube root of x in [0, 1], a third of the exponent from the bits then 3 newton steps
+inline real_t fast_cbrt(real_t x)
+{
+	uint32_t i;
+	memcpy(&i, &x, sizeof(i));
+	i = i / 3 + 709921077u;
+	real_t y;
+	memcpy(&y, &i, sizeof(y));
+	for (int k = 0; k < 3; ++k)
+		y = (2 * y + x / (y * y)) * real_t(1.0 / 3.0);
+	return y;
+}
+
+// uniform direction from 2 uniform numbers, z is uniform in [-1, 1] and the angle around z in
+// [0, 2 pi) which spreads the directions evenly over the sphere (archimedes)
+inline vec3 unit_vector_sample_precise(real_t u1, real_t u2)
+{
+	auto z = -1 + 2 * u1;
+	auto a = real_t(2) * pi * u2;
+	auto r = sqrt(max(real_t(0.0), real_t(1.0) - z * z));
+	return vec3{r * std::cos(a), r * std::sin(a), z};
+}
+
+inline vec3 unit_vector_sample_fast(real_t u1, real_t u2)
 {
-	auto z = random_double(series, -1, 1);
-	auto t = random_double(series, 0, 2 * pi);
+	auto z = -1 + 2 * u1;
 	auto r = sqrt(max(real_t(0.0), real_t(1.0) - z * z));
-	auto x = r * cos(t);
-	auto y = r * sin(t);
-	vec3 res {x, y, z};
-	res *= pow(random_double(series), real_t(1.0 / 3.0));
-	return res;
+	real_t s, c;
+	fast_sincos_turns(u2, s, c);
+	return vec3{r * c, r * s, z};
+}
+
+// uniform point in the unit ball, a direction pushed in to the cube root of the third number
+// since the volume inside radius r grows as r^3
+inline vec3 unit_sphere_sample_precise(real_t u1, real_t u2, real_t u3)
+{
+	return unit_vector_sample_precise(u1, u2) * pow(u3, real_t(1.0 / 3.0));
+}
+
+inline vec3 unit_sphere_sample_fast(real_t u1, real_t u2, real_t u3)
+{
+	return unit_vector_sample_fast(u1, u2) * fast_cbrt(u3);
+}
+
+// maps [0, 1]^2 to the unit disk without rejection (Shirley and Chiu), squares around the
+// center go to rings so the samples keep their stratification
+inline void concentric_disk_sample_precise(real_t s, real_t t, real_t& x, real_t& y)
+{
+	auto a = 2 * s - 1;
+	auto b = 2 * t - 1;
+	if (a == 0 && b == 0)
+	{
+		x = 0;
+		y = 0;
+		return;
+	}
+
+	real_t r, phi;
+	if (fabs(a) > fabs(b))
+	{
+		r = a;
+		phi = (pi / 4) * (b / a);
+	}
+	else
+	{
+		r = b;
+		phi = (pi / 2) - (pi / 4) * (a / b);
+	}
+	x = r * cos(phi);
+	y = r * sin(phi);
+}
+
+// the same mapping with the angle in turns and the octant picked by blending with a 0 or 1
+// mask, which unlike ?: doesn't stop the loops it's in from vectorizing, a negative radius
+// turns the point around by half a turn so phi stays in [-1/8, 3/8]
+inline void concentric_disk_sample_fast(real_t s, real_t t, real_t& x, real_t& y)
+{
+	auto a = 2 * s - 1;
+	auto b = 2 * t - 1;
+	auto a_major = real_t(std::fabs(a) > std::fabs(b));
+	auto r = b + a_major * (a - b);
+	auto minor = a + a_major * (b - a);
+	auto ratio = minor / (r + real_t(r == 0));
+	auto phi = (1 - a_major) * real_t(0.25) + (2 * a_major - 1) * real_t(0.125) * ratio;
+	real_t sin_phi, cos_phi;
+	fast_sincos_turns(phi, sin_phi, cos_phi);
+	x = r * cos_phi;
+	y = r * sin_phi;
+}
+
+#if FAST_SAMPLING
+inline vec3 unit_vector_sample(real_t u1, real_t u2) { return unit_vector_sample_fast(u1, u2); }
+inline vec3 unit_sphere_sample(real_t u1, real_t u2, real_t u3) { return unit_sphere_sample_fast(u1, u2, u3); }
+inline void concentric_disk_sample(real_t s, real_t t, real_t& x, real_t& y) { concentric_disk_sample_fast(s, t, x, y); }
+#else
+inline vec3 unit_vector_sample(real_t u1, real_t u2) { return unit_vector_sample_precise(u1, u2); }
+inline vec3 unit_sphere_sample(real_t u1, real_t u2, real_t u3) { return unit_sphere_sample_precise(u1, u2, u3); }
+inline void concentric_disk_sample(real_t s, real_t t, real_t& x, real_t& y) { concentric_disk_sample_precise(s, t, x, y); }
+#endif
+
+vec3 random_in_unit_sphere(random_series* series)
+{
+	auto u1 = random_double(series);
+	auto u2 = random_double(series);
+	return unit_sphere_sample(u1, u2, random_double(series));
 }
 
 vec3 random_unit_vector(random_series* series)
 {
-	auto z = random_double(series, -1, 1);
-	auto a = random_double(series, 0, 2 * pi);
-	auto r = sqrt(real_t(1.0) - z * z);
-	auto x = r * cos(a);
-	auto y = r * sin(a);
-	return vec3{ x, y, z };
+	auto u1 = random_double(series);
+	return unit_vector_sample(u1, random_double(series));
 }
 
 // old ray tracing book
@@ -370,10 +516,8 @@ vec3 refract(const vec3& uv, const vec3& n, real_t etai_over_etat)
 
 vec3 random_in_unit_disk(random_series* series)
 {
-	while (true)
-	{
-		auto p = vec3(random_double(series, -1, 1), random_double(series, -1, 1), 0);
-		if (p.length_squared() >= 1) continue;
-		return p;
-	}
+	auto s = random_double(series);
+	real_t x, y;
+	concentric_disk_sample(s, random_double(series), x, y);
+	return vec3{x, y, 0};
 }
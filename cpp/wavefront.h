@@ -0,0 +1,562 @@
+#pragma once
+
+#include "rtweekend.h"
+#include "camera.h"
+#include "hittable_list.h"
+#include "image.h"
+#include "material.h"
+#include "parallel.h"
+#include "morton.h"
+#include "material_scatter.h"
+#include "random_simd.h"
+#include "denoise.h"
+
+#include <algorithm>
+#include <chrono>
+#include <stdint.h>
+#include <vector>
+
+constexpr uint32_t WAVEFRONT_MIN_RANGE = 256;
+constexpr uint32_t WAVEFRONT_COMPACT_BLOCK = 4096;
+// shading buckets, one per material kind and one for the rays that missed everything
+constexpr int WAVEFRONT_BUCKET_COUNT = 5;
+constexpr int WAVEFRONT_BUCKET_MISS = 4;
+
+enum WAVEFRONT_STAGE
+{
+	WAVEFRONT_STAGE_GENERATE,
+	WAVEFRONT_STAGE_SORT,
+	WAVEFRONT_STAGE_EXTEND,
+	WAVEFRONT_STAGE_SHADE,
+	WAVEFRONT_STAGE_COMPACT,
+	WAVEFRONT_STAGE_COUNT,
+};
+
+static const char* WAVEFRONT_STAGE_NAMES[] = {"generate", "sort", "extend", "shade", "compact"};
+
+// one path per entry, the ray it's about to trace and what it carries so far
+struct ray_queue
+{
+	std::vector<float> origin_x, origin_y, origin_z;
+	std::vector<float> dir_x, dir_y, dir_z;
+	std::vector<float> throughput_r, throughput_g, throughput_b;
+	std::vector<int> pixel;
+	std::vector<random_series> rng;
+	uint32_t count = 0;
+
+	void resize(size_t size)
+	{
+		origin_x.resize(size); origin_y.resize(size); origin_z.resize(size);
+		dir_x.resize(size); dir_y.resize(size); dir_z.resize(size);
+		throughput_r.resize(size); throughput_g.resize(size); throughput_b.resize(size);
+		pixel.resize(size);
+		rng.resize(size);
+	}
+
+	ray get_ray(uint32_t i) const
+	{
+		return ray{point3{origin_x[i], origin_y[i], origin_z[i]}, vec3{dir_x[i], dir_y[i], dir_z[i]}};
+	}
+
+	void set_ray(uint32_t i, const ray& r)
+	{
+		origin_x[i] = r.origin().x(); origin_y[i] = r.origin().y(); origin_z[i] = r.origin().z();
+		dir_x[i] = r.direction().x(); dir_y[i] = r.direction().y(); dir_z[i] = r.direction().z();
+	}
+
+	color throughput(uint32_t i) const
+	{
+		return color{throughput_r[i], throughput_g[i], throughput_b[i]};
+	}
+
+	void set_throughput(uint32_t i, const color& c)
+	{
+		throughput_r[i] = c.x(); throughput_g[i] = c.y(); throughput_b[i] = c.z();
+	}
+
+	void copy(uint32_t dst, const ray_queue& src, uint32_t i)
+	{
+		origin_x[dst] = src.origin_x[i]; origin_y[dst] = src.origin_y[i]; origin_z[dst] = src.origin_z[i];
+		dir_x[dst] = src.dir_x[i]; dir_y[dst] = src.dir_y[i]; dir_z[dst] = src.dir_z[i];
+		throughput_r[dst] = src.throughput_r[i]; throughput_g[dst] = src.throughput_g[i]; throughput_b[dst] = src.throughput_b[i];
+		pixel[dst] = src.pixel[i];
+		rng[dst] = src.rng[i];
+	}
+};
+
+static_assert(sizeof(random_series) == sizeof(uint32_t), "the ispc kernels see the random series as its state");
+
+// closest hits of the queue entries with the same indices, mat_index is -1 for a miss
+struct hit_queue
+{
+	std::vector<float> t;
+	std::vector<float> normal_x, normal_y, normal_z;
+	std::vector<int> mat_index;
+	std::vector<uint8_t> front_face;
+
+	void resize(size_t size)
+	{
+		t.resize(size);
+		normal_x.resize(size); normal_y.resize(size); normal_z.resize(size);
+		mat_index.resize(size);
+		front_face.resize(size);
+	}
+
+	void set(uint32_t i, bool hit, const hit_record& rec)
+	{
+		mat_index[i] = hit ? rec.mat_index : -1;
+		if (hit == false)
+			return;
+		t[i] = rec.t;
+		normal_x[i] = rec.normal.x(); normal_y[i] = rec.normal.y(); normal_z[i] = rec.normal.z();
+		front_face[i] = rec.front_face;
+	}
+
+	hit_record get(uint32_t i, const ray& r) const
+	{
+		hit_record rec{};
+		rec.t = t[i];
+		rec.p = r.at(rec.t);
+		rec.normal = vec3{normal_x[i], normal_y[i], normal_z[i]};
+		rec.mat_index = mat_index[i];
+		rec.front_face = front_face[i] != 0;
+		return rec;
+	}
+};
+
+// the scene materials as soa arrays for the ispc scatter kernels
+struct material_table
+{
+	std::vector<float> albedo_r, albedo_g, albedo_b;
+	std::vector<float> fuzz;
+	std::vector<float> ir;
+
+	void assign(const std::vector<material>& materials)
+	{
+		albedo_r.clear(); albedo_g.clear(); albedo_b.clear();
+		fuzz.clear();
+		ir.clear();
+		for (const auto& m: materials)
+		{
+			albedo_r.push_back(m.albedo.x()); albedo_g.push_back(m.albedo.y()); albedo_b.push_back(m.albedo.z());
+			fuzz.push_back(m.fuzz);
+			ir.push_back(m.ir);
+		}
+	}
+};
+
+struct wavefront_stats
+{
+	real_t elapsed_ms;
+	size_t ray_count;
+	size_t bounces;
+	// wall time spent in each stage and how many rays went through it
+	real_t stage_ms[WAVEFRONT_STAGE_COUNT];
+	size_t stage_rays[WAVEFRONT_STAGE_COUNT];
+	// times the material kind changes between two consecutive hits a shade task goes
+	// through, in the order the hits arrive and after they're bucketed by kind, every change
+	// is a chance for the branch on the kind to be mispredicted
+	size_t shade_kind_switches;
+	size_t shade_sorted_kind_switches;
+	// the sort and extend stages split by bounce, index 0 is the camera rays
+	std::vector<real_t> depth_sort_ms;
+	std::vector<real_t> depth_extend_ms;
+	std::vector<size_t> depth_rays;
+
+	real_t stage_mrays_per_second(int stage) const
+	{
+		if (stage_ms[stage] <= 0)
+			return 0;
+		return (real_t(stage_rays[stage]) / (stage_ms[stage] / 1000.0)) / 1000'000.0;
+	}
+
+	// sums the stage totals of another render into these, the per bounce split is left as is
+	void add_stages(const wavefront_stats& other)
+	{
+		for (int stage = 0; stage < WAVEFRONT_STAGE_COUNT; ++stage)
+		{
+			stage_ms[stage] += other.stage_ms[stage];
+			stage_rays[stage] += other.stage_rays[stage];
+		}
+		shade_kind_switches += other.shade_kind_switches;
+		shade_sorted_kind_switches += other.shade_sorted_kind_switches;
+	}
+};
+
+// stream path tracer, instead of following one path at a time through ray_color every
+// stage runs over all the paths of a sample pass, the rays of all pixels are generated,
+// then extended to their closest hit, then shaded in batches of one material kind, then the
+// paths still alive are compacted into the queue of the next bounce
+struct wavefront_integrator
+{
+	wavefront_integrator(enki::TaskScheduler* t, image* i, const camera* c, const hittable_list* w, int spp, int depth, uint32_t batch = 0)
+		: ts(t),
+		  img(i),
+		  cam(c),
+		  world(w),
+		  samples_per_pixel(spp),
+		  max_depth(depth),
+		  reorder_batch(batch)
+	{}
+
+	enki::TaskScheduler* ts;
+	image* img;
+	const camera* cam;
+	const hittable_list* world;
+	int samples_per_pixel;
+	int max_depth;
+	// rays per batch sorted by direction octant and origin morton code before they're
+	// extended, 0 disables the sort, the camera rays are already coherent so the sort starts
+	// at reorder_min_depth
+	uint32_t reorder_batch = 0;
+	int reorder_min_depth = 1;
+	// add the samples to the image accumulation instead of writing the pixels
+	bool accumulate = false;
+	// KIND_SOBOL takes the pixel jitter and the lens sample from the pixel's sobol sequence,
+	// the bounces draw from the per path xorshift streams either way
+	sampler::KIND sampler_kind = sampler::KIND_RANDOM;
+
+	ray_queue queue, next_queue;
+	hit_queue hits;
+	material_table materials;
+	std::vector<color> accumulator;
+	// first hits of the camera rays of every pixel, filled when the image takes aovs
+	std::vector<aov_sample> aov_accumulator;
+	// accumulator before the current sample, what the sample added is its color
+	std::vector<color> sample_start;
+	std::vector<uint8_t> alive;
+	std::vector<uint32_t> shade_order;
+	std::vector<uint32_t> block_offsets;
+	std::vector<uint64_t> sort_keys;
+	// per thread counters, summed into the stats at the end of the render
+	struct shade_counters
+	{
+		size_t bounces;
+		size_t kind_switches;
+		size_t sorted_kind_switches;
+	};
+	std::vector<shade_counters> thread_counters;
+	wavefront_stats stats;
+
+	wavefront_stats render(random_series series)
+	{
+		stats = wavefront_stats{};
+		auto pixel_count = uint32_t(img->width * img->height);
+		queue.resize(pixel_count);
+		next_queue.resize(pixel_count);
+		hits.resize(pixel_count);
+		alive.resize(pixel_count);
+		shade_order.resize(pixel_count);
+		if (reorder_batch > 0)
+			sort_keys.resize(pixel_count);
+		stats.depth_sort_ms.assign(max_depth, 0);
+		stats.depth_extend_ms.assign(max_depth, 0);
+		stats.depth_rays.assign(max_depth, 0);
+		accumulator.assign(pixel_count, color{});
+		if (img->has_aovs())
+		{
+			aov_accumulator.assign(pixel_count, aov_sample{});
+			sample_start.assign(pixel_count, color{});
+		}
+		materials.assign(world->materials);
+		thread_counters.assign(parallel_thread_count(ts), shade_counters{});
+
+		auto base_seed = xor_shift_32_rand(&series);
+		auto start = std::chrono::high_resolution_clock::now();
+		for (int s = 0; s < samples_per_pixel; ++s)
+		{
+			timed(WAVEFRONT_STAGE_GENERATE, [&] { return generate(uint32_t(s), base_seed); });
+			for (int depth = 0; depth < max_depth && queue.count > 0; ++depth)
+			{
+				stats.depth_rays[depth] += queue.count;
+				stats.depth_sort_ms[depth] += timed(WAVEFRONT_STAGE_SORT, [&] { return sort(depth); });
+				stats.depth_extend_ms[depth] += timed(WAVEFRONT_STAGE_EXTEND, [&] { return extend(); });
+				if (depth == 0 && img->has_aovs())
+					add_aovs();
+				timed(WAVEFRONT_STAGE_SHADE, [&] { return shade(); });
+				timed(WAVEFRONT_STAGE_COMPACT, [&] { return compact(); });
+			}
+			if (img->has_aovs())
+				add_sample_luminance();
+		}
+
+		auto scale = 1.0 / samples_per_pixel;
+		parallel_for(ts, pixel_count, WAVEFRONT_MIN_RANGE, [&](uint32_t begin, uint32_t end, uint32_t) {
+			for (auto i = begin; i < end; ++i)
+			{
+				if (accumulate)
+					img->accumulation[i] += accumulator[i];
+				else
+					img->pixels[i] = sqrt(accumulator[i] * scale);
+				if (img->has_aovs())
+					img->store_aovs(i, aov_accumulator[i], samples_per_pixel, accumulate ? img->accumulated_samples : 0);
+			}
+		});
+		auto end = std::chrono::high_resolution_clock::now();
+
+		stats.elapsed_ms = std::chrono::duration<real_t, std::milli>(end - start).count();
+		for (const auto& c: thread_counters)
+		{
+			stats.bounces += c.bounces;
+			stats.shade_kind_switches += c.kind_switches;
+			stats.shade_sorted_kind_switches += c.sorted_kind_switches;
+		}
+		return stats;
+	}
+
+	// func returns the number of rays the stage went through, returns the stage time
+	template<typename F>
+	real_t timed(WAVEFRONT_STAGE stage, F&& func)
+	{
+		auto start = std::chrono::high_resolution_clock::now();
+		stats.stage_rays[stage] += func();
+		auto end = std::chrono::high_resolution_clock::now();
+		auto ms = std::chrono::duration<real_t, std::milli>(end - start).count();
+		stats.stage_ms[stage] += ms;
+		return ms;
+	}
+
+	// one camera ray per pixel, generated a row at a time straight into the queue, every
+	// row and every path get their own stream so the result doesn't depend on which thread
+	// runs them
+	uint32_t generate(uint32_t sample, uint32_t base_seed)
+	{
+		auto width = img->width;
+		auto pixel_count = uint32_t(img->width * img->height);
+		auto sobol_sample = uint32_t(accumulate ? img->accumulated_samples : 0) + sample;
+		parallel_for(ts, uint32_t(img->height), 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+			for (auto y = begin; y < end; ++y)
+			{
+				auto first = y * uint32_t(width);
+				if (sampler_kind == sampler::KIND_SOBOL)
+				{
+					cam->get_sobol_rays(sobol_sample, 0, int(y), width, int(y) + 1, 1, img->width, img->height,
+						&queue.origin_x[first], &queue.origin_y[first], &queue.origin_z[first],
+						&queue.dir_x[first], &queue.dir_y[first], &queue.dir_z[first]);
+				}
+				else
+				{
+					auto camera_series = random_series_x4_seed(base_seed + sample, pixel_count + 4 * y);
+					cam->get_rays(&camera_series, 0, int(y), width, int(y) + 1, 1, img->width, img->height,
+						&queue.origin_x[first], &queue.origin_y[first], &queue.origin_z[first],
+						&queue.dir_x[first], &queue.dir_y[first], &queue.dir_z[first]);
+				}
+
+				for (auto i = first; i < first + uint32_t(width); ++i)
+				{
+					queue.set_throughput(i, color{1, 1, 1});
+					queue.pixel[i] = int(i);
+					queue.rng[i] = random_series{random_seed(base_seed + sample, i)};
+				}
+			}
+		});
+		queue.count = pixel_count;
+		stats.ray_count += queue.count;
+		return queue.count;
+	}
+
+	// reorders every batch of the queue so that rays going the same way from nearby origins
+	// are traced one after the other and touch the same nodes, the key is the direction
+	// octant on top of the 30 bit morton code of the origin quantized to the batch bounds,
+	// with the ray's index in the batch in the low bits so the sort is on plain integers
+	uint32_t sort(int depth)
+	{
+		if (reorder_batch == 0 || depth < reorder_min_depth)
+			return 0;
+
+		auto batch_count = (queue.count + reorder_batch - 1) / reorder_batch;
+		parallel_for(ts, batch_count, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+			for (auto batch = begin; batch < end; ++batch)
+			{
+				auto first = batch * reorder_batch;
+				auto last = std::min(queue.count, first + reorder_batch);
+
+				aabb bounds{};
+				for (auto i = first; i < last; ++i)
+					bounds.expand(point3{queue.origin_x[i], queue.origin_y[i], queue.origin_z[i]});
+
+				for (auto i = first; i < last; ++i)
+				{
+					uint64_t octant = (queue.dir_x[i] < 0) | ((queue.dir_y[i] < 0) << 1) | ((queue.dir_z[i] < 0) << 2);
+					uint64_t code = morton_encode(bounds, point3{queue.origin_x[i], queue.origin_y[i], queue.origin_z[i]});
+					sort_keys[i] = (((octant << 30) | code) << 31) | (i - first);
+				}
+				std::sort(sort_keys.begin() + first, sort_keys.begin() + last);
+
+				for (auto i = first; i < last; ++i)
+					next_queue.copy(i, queue, first + uint32_t(sort_keys[i] & 0x7FFFFFFF));
+			}
+		});
+
+		next_queue.count = queue.count;
+		std::swap(queue, next_queue);
+		return queue.count;
+	}
+
+	// closest hit of every ray in the queue
+	uint32_t extend()
+	{
+		parallel_for(ts, queue.count, WAVEFRONT_MIN_RANGE, [&](uint32_t begin, uint32_t end, uint32_t) {
+			for (auto i = begin; i < end; ++i)
+			{
+				hit_record rec;
+				bool hit = world->closest_hit(queue.get_ray(i), 0.001, infinity, rec);
+				hits.set(i, hit, rec);
+			}
+		});
+		return queue.count;
+	}
+
+	// adds the first hits of the camera rays in the queue to their pixels
+	void add_aovs()
+	{
+		parallel_for(ts, queue.count, WAVEFRONT_MIN_RANGE, [&](uint32_t begin, uint32_t end, uint32_t) {
+			for (auto i = begin; i < end; ++i)
+			{
+				auto r = queue.get_ray(i);
+				auto hit = hits.mat_index[i] != -1;
+				aov_accumulator[queue.pixel[i]] += first_hit_aovs(*world, r, hit, hit ? hits.get(i, r) : hit_record{});
+			}
+		});
+	}
+
+	// adds the luminance of the sample every pixel just finished to its aovs
+	void add_sample_luminance()
+	{
+		parallel_for(ts, uint32_t(accumulator.size()), WAVEFRONT_MIN_RANGE, [&](uint32_t begin, uint32_t end, uint32_t) {
+			for (auto i = begin; i < end; ++i)
+			{
+				aov_accumulator[i].add_luminance(accumulator[i] - sample_start[i]);
+				sample_start[i] = accumulator[i];
+			}
+		});
+	}
+
+	int bucket(uint32_t i) const
+	{
+		auto mat_index = hits.mat_index[i];
+		return mat_index == -1 ? WAVEFRONT_BUCKET_MISS : int(world->materials[mat_index].kind);
+	}
+
+	// every shade task buffers the hits of its range into one bucket per material kind, a
+	// counting sort in shade_order, and then runs each bucket through the ispc scatter kernel
+	// of its kind, so the kind is branched on once per bucket instead of once per hit and the
+	// bucket is shaded a vector of paths at a time
+	uint32_t shade()
+	{
+		ispc::RayQueue ispc_queue{
+			queue.origin_x.data(), queue.origin_y.data(), queue.origin_z.data(),
+			queue.dir_x.data(), queue.dir_y.data(), queue.dir_z.data(),
+			queue.throughput_r.data(), queue.throughput_g.data(), queue.throughput_b.data(),
+			(uint32_t*)queue.rng.data(),
+		};
+		ispc::HitQueue ispc_hits{
+			hits.t.data(), hits.normal_x.data(), hits.normal_y.data(), hits.normal_z.data(),
+			hits.mat_index.data(), hits.front_face.data(),
+		};
+		ispc::MaterialTable ispc_materials{
+			materials.albedo_r.data(), materials.albedo_g.data(), materials.albedo_b.data(),
+			materials.fuzz.data(), materials.ir.data(),
+		};
+
+		parallel_for(ts, queue.count, WAVEFRONT_MIN_RANGE, [&](uint32_t begin, uint32_t end, uint32_t thread_ix) {
+			auto& counters = thread_counters[thread_ix];
+
+			uint32_t bucket_start[WAVEFRONT_BUCKET_COUNT + 1]{};
+			int previous_bucket = -1;
+			for (auto i = begin; i < end; ++i)
+			{
+				auto b = bucket(i);
+				++bucket_start[b + 1];
+				counters.kind_switches += b != previous_bucket;
+				previous_bucket = b;
+			}
+			bucket_start[0] = begin;
+			for (int b = 0; b < WAVEFRONT_BUCKET_COUNT; ++b)
+				bucket_start[b + 1] += bucket_start[b];
+
+			uint32_t cursor[WAVEFRONT_BUCKET_COUNT];
+			for (int b = 0; b < WAVEFRONT_BUCKET_COUNT; ++b)
+				cursor[b] = bucket_start[b];
+			for (auto i = begin; i < end; ++i)
+				shade_order[cursor[bucket(i)]++] = i;
+
+			for (int b = 0; b < WAVEFRONT_BUCKET_COUNT; ++b)
+				counters.sorted_kind_switches += bucket_start[b + 1] > bucket_start[b];
+
+			shade_miss(bucket_start[WAVEFRONT_BUCKET_MISS], bucket_start[WAVEFRONT_BUCKET_MISS + 1]);
+			shade_emissive(bucket_start[material::KIND_EMISSIVE], bucket_start[material::KIND_EMISSIVE + 1]);
+			auto scatter_bucket = [&](material::KIND kind, auto&& kernel) {
+				counters.bounces += kernel(ispc_queue, ispc_hits, ispc_materials, shade_order.data(), int(bucket_start[kind]), int(bucket_start[kind + 1]), alive.data());
+			};
+			scatter_bucket(material::KIND_LAMBERTIAN, ispc::scatter_lambertian);
+			scatter_bucket(material::KIND_METAL, ispc::scatter_metal);
+			scatter_bucket(material::KIND_DIELECTRIC, ispc::scatter_dielectric);
+		});
+		return queue.count;
+	}
+
+	// paths that missed everything pick up the sky and end
+	void shade_miss(uint32_t first, uint32_t last)
+	{
+		for (auto o = first; o < last; ++o)
+		{
+			auto i = shade_order[o];
+			auto unit_direction = unit_vector(vec3{queue.dir_x[i], queue.dir_y[i], queue.dir_z[i]});
+			auto t = 0.5 * (unit_direction.y() + 1.0);
+			auto sky = (1.0 - t) * color{1.0, 1.0, 1.0} + t * color{0.5, 0.7, 1.0};
+			accumulator[queue.pixel[i]] += queue.throughput(i) * world->sky_intensity * sky;
+			alive[i] = 0;
+		}
+	}
+
+	// paths that hit a light pick up its emission and end, the lights aren't sampled so this
+	// is plain path tracing, see shade_nee in main.cpp for the version that samples them
+	void shade_emissive(uint32_t first, uint32_t last)
+	{
+		for (auto o = first; o < last; ++o)
+		{
+			auto i = shade_order[o];
+			accumulator[queue.pixel[i]] += queue.throughput(i) * world->materials[hits.mat_index[i]].emit;
+			alive[i] = 0;
+		}
+	}
+
+	// moves the paths still alive to the front of the next queue keeping their order,
+	// each block counts its survivors, a prefix sum gives every block its output offset
+	uint32_t compact()
+	{
+		auto count = queue.count;
+		auto block_count = (queue.count + WAVEFRONT_COMPACT_BLOCK - 1) / WAVEFRONT_COMPACT_BLOCK;
+		block_offsets.assign(block_count + 1, 0);
+		parallel_for(ts, block_count, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+			for (auto block = begin; block < end; ++block)
+			{
+				auto first = block * WAVEFRONT_COMPACT_BLOCK;
+				auto last = std::min(queue.count, first + WAVEFRONT_COMPACT_BLOCK);
+				uint32_t survivors = 0;
+				for (auto i = first; i < last; ++i)
+					survivors += alive[i];
+				block_offsets[block + 1] = survivors;
+			}
+		});
+		for (uint32_t block = 0; block < block_count; ++block)
+			block_offsets[block + 1] += block_offsets[block];
+
+		parallel_for(ts, block_count, 1, [&](uint32_t begin, uint32_t end, uint32_t) {
+			for (auto block = begin; block < end; ++block)
+			{
+				auto first = block * WAVEFRONT_COMPACT_BLOCK;
+				auto last = std::min(queue.count, first + WAVEFRONT_COMPACT_BLOCK);
+				auto dst = block_offsets[block];
+				for (auto i = first; i < last; ++i)
+					if (alive[i])
+						next_queue.copy(dst++, queue, i);
+			}
+		});
+
+		next_queue.count = block_offsets[block_count];
+		std::swap(queue, next_queue);
+		return count;
+	}
+};